@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// bump allocator for the scratch memory of a decode
+// Allocate hands out zeroed memory that lives until Reset, nothing is freed
+// one piece at a time; Reset keeps the blocks, merged into one, so a decoder
+// reused for many files stops allocating once it has seen its largest file
+// Allocate is thread safe, Reset and Release must not race with it
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    class Arena
+    {
+    public:
+        Arena() = default;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        Arena(Arena&& other) noexcept { *this = move(other); }
+        Arena& operator=(Arena&& other) noexcept
+        {
+            blocks = move(other.blocks);
+            current = other.current;
+            used = other.used;
+            peak = other.peak;
+            allocations = other.allocations;
+            allocatedBytes = other.allocatedBytes;
+            other.Release();
+            return *this;
+        }
+
+        // count zeroed T, aligned to a cache line
+        template<typename T>
+        span<T> Allocate(size_t count)
+        {
+            static_assert(is_trivially_copyable_v<T>, "arena memory is not constructed");
+            if (count == 0)
+                return {};
+            const size_t bytes = (count * sizeof(T) + Align - 1) & ~(Align - 1);
+
+            lock_guard<mutex> lock(m);
+            while (current < blocks.size() && used + bytes > blocks[current].size)
+            { // move on, the rest of this block is wasted until Reset
+                ++current;
+                used = 0;
+            }
+            if (current == blocks.size())
+            {
+                size_t size = max(bytes, MinBlock);
+                for (const auto& b : blocks)
+                    size = max(size, 2 * b.size); // grow geometrically
+                AddBlock(size);
+                used = 0;
+            }
+            uint8_t* p = blocks[current].Start() + used;
+            used += bytes;
+            peak = max(peak, Used());
+            memset(p, 0, bytes);
+            return span<T>(reinterpret_cast<T*>(p), count);
+        }
+
+        // everything allocated is invalid after this, the memory is kept
+        void Reset()
+        {
+            if (blocks.size() > 1)
+            { // one block the size of all of them fits the same decode next time
+                size_t size = 0;
+                for (const auto& b : blocks)
+                    size += b.size;
+                blocks.clear();
+                AddBlock(size);
+            }
+            current = 0;
+            used = 0;
+        }
+
+        // free the memory too
+        void Release()
+        {
+            blocks.clear();
+            current = 0;
+            used = 0;
+            peak = 0;
+        }
+
+        size_t Capacity() const
+        {
+            size_t size = 0;
+            for (const auto& b : blocks)
+                size += b.size;
+            return size;
+        }
+
+        // bytes in use, including those skipped at the end of full blocks
+        size_t Used() const
+        {
+            size_t size = used;
+            for (size_t i = 0; i < current && i < blocks.size(); ++i)
+                size += blocks[i].size;
+            return size;
+        }
+
+        size_t Peak() const { return peak; } // most bytes in use at once since Release
+
+        // blocks allocated and their bytes, since construction
+        size_t Allocations() const { return allocations; }
+        size_t AllocatedBytes() const { return allocatedBytes; }
+
+    private:
+        struct Block
+        {
+            unique_ptr<uint8_t[]> bytes; // Align extra, to align the start
+            size_t size{ 0 };
+            uint8_t* Start() const
+            {
+                const auto p = reinterpret_cast<uintptr_t>(bytes.get());
+                return bytes.get() + ((Align - p % Align) % Align);
+            }
+        };
+
+        void AddBlock(size_t size)
+        {
+            blocks.push_back(Block{ make_unique<uint8_t[]>(size + Align), size });
+            ++allocations;
+            allocatedBytes += size;
+        }
+
+        static constexpr size_t Align = 64;
+        static constexpr size_t MinBlock = 64 * 1024;
+
+        mutex m;
+        vector<Block> blocks;
+        size_t current{ 0 }; // block being filled
+        size_t used{ 0 }; // bytes used in it
+        size_t peak{ 0 };
+        size_t allocations{ 0 }, allocatedBytes{ 0 };
+    };
+}
@@ -6,15 +6,15 @@ using namespace Lomont::Jpeg;
 #include <iostream>
 #include <filesystem>
 #include <set>
+#include <sstream>
 
 //--------------------------------------------------------------------------//
 using namespace ::std;
 namespace fs = ::std::filesystem;
 
-void WritePPMs(const std::string& originalFilename, const JpegDecoder& dec)
+// images go to filestem_1.ppm, filestem_2.ppm, ...
+void WritePPMs(const std::string& filestem, const JpegDecoder& dec, ostream& out)
 { 
-    const auto filestem = fs::path(originalFilename).stem().string(); // path/and/filename_stem
-
     for (size_t i = 0; i < dec.images.size(); ++i)
     {
         string filename = filestem;
@@ -23,25 +23,49 @@ void WritePPMs(const std::string& originalFilename, const JpegDecoder& dec)
         filename += ".ppm";
         WritePPM(filename, dec.images[i]);
 
-        cout << "Image " << filename << " written\n";
+        out << "Image " << filename << " written\n";
     }
 }
-void WriteHDRInfo(const std::string& originalFilename, const UltraHdr & hdr)
+void WriteHDRInfo(const std::string& originalFilename, const std::string& filestem, const UltraHdr & hdr, ostream& out)
 {
-    const auto filestem = fs::path(originalFilename).stem().string(); // path/and/filename_stem
     const string filename = filestem + ".txt";
     ofstream file(filename);
     file << format("HDR info for {}\n", originalFilename);
     hdr.Dump(file);
     file.close();
-    cout << "HDR info " << filename << " written\n";
+    out << "HDR info " << filename << " written\n";
 }
 
+// per file decode stats, one CSV row each, or JSON when the name ends in .json
+void WriteStats(const string& filename, const BatchResults& results)
+{
+    const bool json = filename.ends_with(".json");
+    ofstream file(filename);
+    file << (json ? "[\n" : DecodeStats::CsvHeader() + "\n");
+    bool first = true;
+    for (const auto& r : results.files)
+    {
+        if (!r.stats)
+            continue;
+        if (json)
+            file << (first ? "" : ",\n") << r.stats->Json();
+        else
+            file << r.stats->Csv() << "\n";
+        first = false;
+    }
+    if (json)
+        file << "\n]\n";
+    file.close();
+    cout << format("Stats {} written\n", filename);
+}
+
+// statsFilename, when not empty, gets the decode stats of each file, see WriteStats
 void ProcessFiles(
     const string& pathOrFilename,
     bool saveFile = false,
     LogType errMin = LogType::ERROR,
-    bool outputErrorsOnly = false
+    bool outputErrorsOnly = false,
+    const string& statsFilename = ""
 )
 {
     set<fs::path> sorted_by_name;
@@ -62,51 +86,86 @@ void ProcessFiles(
 
     cout << format("{} files to check\n", sorted_by_name.size());
 
-    int fileCount = 0, errorCount = 0;
+    // decode all files in parallel, output is collected per file and shown in sorted order
+    const vector<string> filenames(sorted_by_name.begin(), sorted_by_name.end());
+    vector<string> written(filenames.size()); // messages from saving files
 
-    for (auto& p : sorted_by_name)
+    // output names, files are written concurrently so no two may share one
+    // the path under the directory, ex: sub/x.jpg gives sub_x, a number is added to repeats
+    vector<string> filestems;
+    set<string> usedStems;
+    for (size_t i = 0; i < filenames.size(); ++i)
     {
-        auto fn = p.string();
-        JpegDecoder dec;
-        dec.logLevel = errMin;
-        // we'll override output, so we can block it on errorOnly dumps
-        stringstream s;
-        dec.output = [&](const string& msg) {s << msg; };
-        fileCount++;
-        try {
-            Decode(fn, dec);
+        const fs::path p(filenames[i]);
+        fs::path rel = sorted_by_name.size() == 1 ? p.filename() : fs::relative(p, pathOrFilename);
+        rel.replace_extension();
+        string base = rel.generic_string();
+        replace(base.begin(), base.end(), '/', '_');
+        string stem = base;
+        for (int n = 2; !usedStems.insert(stem).second; ++n)
+            stem = format("{}_{}", base, n);
+        filestems.push_back(stem);
+    }
+
+    auto results = DecodeFiles(
+        filenames,
+        [&](JpegDecoder& dec)
+        {
+            dec.logLevel = errMin;
+            if (!statsFilename.empty() && !dec.stats)
+                dec.stats = make_shared<DecodeStats>();
+        },
+        [&](size_t index, JpegDecoder& dec)
+        {
             if (dec.errorCount == 0 && saveFile)
-            {
-                WritePPMs(fn, dec);
+            { // writing files counts as output
+                const auto start = StatClock();
+                const auto& fn = filenames[index];
+                const auto& filestem = filestems[index];
+                stringstream s;
+                WritePPMs(filestem, dec, s);
                 if (dec.hdr.hasUltraHdr)
                 {
-                    WriteHDRInfo(fn, dec.hdr);
-                    const auto filestem = fs::path(fn).stem().string(); // path/and/filename_stem
+                    WriteHDRInfo(fn, filestem, dec.hdr, s);
                     SplitMultipartFile(fn, filestem, dec);
                 }
+                written[index] = s.str();
+                if (dec.stats)
+                {
+                    const auto ns = StatClock() - start;
+                    dec.stats->Add(StatPhase::Output, ns);
+                    dec.stats->totalNs += ns;
+                }
             }
-        }
-        catch (exception& e)
-        {
+        });
+
+    int fileCount = 0, errorCount = 0;
+
+    for (size_t i = 0; i < results.files.size(); ++i)
+    {
+        const auto& r = results.files[i];
+        fileCount++;
+        if (r.exception)
             cout << "Exception \n";
-            dec.loge("Exception!\n");
-        }
+        cout << written[i];
         // dump errors only
         if (outputErrorsOnly)
         {
-            if (/* dec.warningCount>0 || */ dec.errorCount > 0)
+            if (/* r.warningCount>0 || */ r.errorCount > 0)
             {
-                cout << s.str() << endl;
+                cout << r.log << endl;
                 errorCount++;
             }
         }
         else
         {
-            cout << s.str() << endl;
+            cout << r.log << endl;
         }
 
     }
     cout << format("{} files, {} with errors\n", fileCount, errorCount);
+    if (!statsFilename.empty())
+        WriteStats(statsFilename, results);
 }
 
 int main(int argc, char * argv[])
@@ -117,12 +176,15 @@ int main(int argc, char * argv[])
     LogType minLevel = LogType::INFO;
     bool transcodeFile = true; // saves as filename.ppm
     bool dumpOnErrorOnly = false;
+    string statsFilename = ""; // ex: "stats.csv" or "stats.json"
 
     if (argc > 1)
     {
         processLocation = argv[1];
         cout << processLocation << endl;
     }
+    if (argc > 2)
+        statsFilename = argv[2];
 
     // HDR testing
     processLocation = "HDR/Pixel6-Original.jpg"; // 4080x3072x3 (Y,Cb,Cr), 1020x768x1 (Y) 
@@ -132,7 +194,8 @@ int main(int argc, char * argv[])
         processLocation,
         transcodeFile,
         minLevel,
-        dumpOnErrorOnly
+        dumpOnErrorOnly,
+        statsFilename
         );
    
     return 0;
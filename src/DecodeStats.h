@@ -0,0 +1,143 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <string>
+
+// optional instrumentation of a decode, set JpegDecoder::stats to collect it
+// entropy, idct and color times are summed over the threads doing them, so
+// with threads they can add up to more than the total
+// the other phases are timed on the calling thread, and only while no
+// workers run, so nothing here needs a lock of its own
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    enum class StatPhase
+    {
+        Markers, // marker segments and frame setup, not metadata
+        Entropy, // Huffman decoding, restart markers
+        Idct, // dequantize and inverse DCT
+        Color, // upsampling, color conversion and storing pixels, or planes
+        Metadata, // EXIF, ICC, XMP, MPF and UltraHDR decoders
+        Output, // onScanlines and onPreview callbacks, and whatever the caller adds
+        Count
+    };
+
+    inline const char* PhaseName(StatPhase phase)
+    {
+        static const char* names[] = { "markers", "entropy", "idct", "color", "metadata", "output" };
+        return names[static_cast<int>(phase)];
+    }
+
+    // high resolution clock, in nanoseconds
+    inline int64_t StatClock()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // counts kept by one decoding thread, added to the stats when it is done
+    struct StatCounters
+    {
+        bool on{ false }; // stats are wanted, else nothing is timed
+        int64_t entropyNs{ 0 }, idctNs{ 0 }, colorNs{ 0 };
+        uint64_t mcus{ 0 }, blocks{ 0 }, zeroBlocks{ 0 };
+    };
+
+    struct DecodeStats
+    {
+        string filename;
+        int64_t totalNs{ 0 };
+        int64_t phaseNs[static_cast<int>(StatPhase::Count)]{};
+        uint64_t bytes{ 0 }; // input consumed
+        uint64_t images{ 0 }, scans{ 0 };
+        uint64_t mcus{ 0 }, blocks{ 0 }; // entropy decoded, progressive counts blocks reconstructed, previews too
+        uint64_t zeroBlocks{ 0 }; // blocks with no AC coefficients
+        uint64_t allocations{ 0 }, allocatedBytes{ 0 }; // scratch arena blocks and image storage grown
+
+        // set by the decoder while it runs
+        int64_t startNs{ 0 };
+        uint64_t arenaAllocations{ 0 }, arenaBytes{ 0 };
+
+        int64_t Ns(StatPhase phase) const { return phaseNs[static_cast<int>(phase)]; }
+        double Seconds(StatPhase phase) const { return Ns(phase) * 1e-9; }
+        double TotalSeconds() const { return totalNs * 1e-9; }
+
+        void Add(StatPhase phase, int64_t ns) { phaseNs[static_cast<int>(phase)] += ns; }
+        void Add(const StatCounters& c)
+        {
+            Add(StatPhase::Entropy, c.entropyNs);
+            Add(StatPhase::Idct, c.idctNs);
+            Add(StatPhase::Color, c.colorNs);
+            mcus += c.mcus;
+            blocks += c.blocks;
+            zeroBlocks += c.zeroBlocks;
+        }
+        void Allocated(uint64_t byteCount)
+        {
+            ++allocations;
+            allocatedBytes += byteCount;
+        }
+
+        static string CsvHeader()
+        {
+            string s = "filename,total_s";
+            for (int p = 0; p < static_cast<int>(StatPhase::Count); ++p)
+                s += format(",{}_s", PhaseName(static_cast<StatPhase>(p)));
+            return s + ",bytes,images,scans,mcus,blocks,zero_blocks,allocations,allocated_bytes";
+        }
+
+        // one row, fields as CsvHeader
+        string Csv() const
+        {
+            string name = "\""; // quoted, quotes doubled
+            for (const char ch : filename)
+                name += ch == '"' ? "\"\"" : string(1, ch);
+            name += '"';
+            string s = format("{},{:.6f}", name, TotalSeconds());
+            for (int p = 0; p < static_cast<int>(StatPhase::Count); ++p)
+                s += format(",{:.6f}", Seconds(static_cast<StatPhase>(p)));
+            return s + format(",{},{},{},{},{},{},{},{}",
+                bytes, images, scans, mcus, blocks, zeroBlocks, allocations, allocatedBytes);
+        }
+
+        // one object on one line
+        string Json() const
+        {
+            string name;
+            for (const char ch : filename)
+            {
+                if (ch == '"' || ch == '\\')
+                    name += '\\';
+                if (static_cast<unsigned char>(ch) < 0x20)
+                    name += format("\\u{:04x}", static_cast<int>(ch));
+                else
+                    name += ch;
+            }
+            string s = format("{{\"filename\":\"{}\",\"total_s\":{:.6f},\"phases_s\":{{", name, TotalSeconds());
+            for (int p = 0; p < static_cast<int>(StatPhase::Count); ++p)
+                s += format("{}\"{}\":{:.6f}", p ? "," : "", PhaseName(static_cast<StatPhase>(p)), Seconds(static_cast<StatPhase>(p)));
+            return s + format("}},\"bytes\":{},\"images\":{},\"scans\":{},\"mcus\":{},\"blocks\":{},\"zero_blocks\":{},\"allocations\":{},\"allocated_bytes\":{}}}",
+                bytes, images, scans, mcus, blocks, zeroBlocks, allocations, allocatedBytes);
+        }
+    };
+
+    // adds the time to the end of the scope to a phase, does nothing without stats
+    class StatTimer
+    {
+    public:
+        StatTimer(DecodeStats* stats, StatPhase phase) : stats(stats), phase(phase), start(stats ? StatClock() : 0) {}
+        ~StatTimer()
+        {
+            if (stats)
+                stats->Add(phase, StatClock() - start);
+        }
+        StatTimer(const StatTimer&) = delete;
+        StatTimer& operator=(const StatTimer&) = delete;
+
+    private:
+        DecodeStats* stats;
+        StatPhase phase;
+        int64_t start;
+    };
+}
@@ -14,10 +14,10 @@ namespace Lomont::Jpeg {
 	class ExifDecoder : public TiffDecoder
 	{
 	public:
-		bool Decode(Logger& dec, const vector<uint8_t>& data)
+		bool Decode(Logger& dec, span<const uint8_t> data)
 		{
 			this->dec = &dec;
-			this->data = &data;
+			this->data = data;
 
 			// description https://www.media.mit.edu/pia/Research/deepview/exif.html
 			// see also https://www.iptc.org/std-dev/photometadata/documentation/mapping-guidelines/
@@ -51,16 +51,16 @@ namespace Lomont::Jpeg {
 				//   - 2 byte data format
 				//   - 4 bytes # of components
 				//   - 4 byte offset to data
-			dec->logi(format("Exif has {} entries\n", ifds.size()));
+			dec->logi("Exif has {} entries\n", ifds.size());
 			for (auto& ifd : ifds)
 			{
 				auto t = GetTag(ifd.tag);
 				ifd.desc = t.txt;
 				ifd.txt = t.desc;
 
-				dec->logi(format("  tag {:02X}, form {}, comp {}, offs {}: {}\n",
+				dec->logi("  tag {:02X}, form {}, comp {}, offs {}: {}\n",
 					ifd.tag, ifd.form, ifd.count, ifd.offset, ifd.desc
-				));
+				);
 			}
 			return true;
 		}
@@ -13,10 +13,10 @@ namespace Lomont::Jpeg {
 	public:
 
 
-		bool Decode(Logger& dec, const vector<uint8_t>& data)
+		bool Decode(Logger& dec, span<const uint8_t> data)
 		{
 			this->dec = &dec;
-			this->data = &data;
+			this->data = data;
 			
 			// check for ICC profile https://www.color.org/ICC1V42.pdf
 
@@ -178,12 +178,12 @@ namespace Lomont::Jpeg {
 			int len = n;
 			for (int p = 0; p < n; ++p)
 			{
-				if (readPos >= data->size())
+				if (readPos >= data.size())
 				{
 					error = true;
 					break;
 				}
-				uint32_t d = (*data)[readPos++];
+				uint32_t d = data[readPos++];
 				v = 256 * v + d;
 			}
 			return v;
@@ -0,0 +1,304 @@
+#include "JpegDecoder.h"
+#include "SyntheticJpeg.h"
+
+using namespace Lomont::Jpeg;
+
+#include <chrono>
+#include <filesystem>
+#include <set>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+// decode throughput benchmark
+// decodes a corpus of files from memory repeatedly in each decoder mode, and
+// reports MB/s of jpeg input, megapixels/s of output, decode latency
+// percentiles and peak RSS per mode and corpus group
+//
+// usage: JpegBenchmark [options] [files or directories]
+//   with no paths, jpegtests and HDR, run from the repository root
+//   --modes list     comma separated, of fast, fast-mt, ref, ref-mt (default fast,fast-mt,ref)
+//   --repeat n       timed passes over the corpus (default 5), one untimed pass goes first
+//   --no-synthetic   skip the generated images
+//   --files          a row per file instead of per group
+//   --csv file       also write the rows as CSV
+
+//--------------------------------------------------------------------------//
+using namespace ::std;
+namespace fs = ::std::filesystem;
+
+struct Input
+{
+    string name;
+    string group; // rows are per group unless per file
+    vector<uint8_t> bytes;
+};
+
+struct Mode
+{
+    string name;
+    IdctMode idct;
+    int threads; // as JpegDecoder::threads
+};
+
+const Mode modes[] = {
+    { "fast", IdctMode::Fast, 1 },
+    { "fast-mt", IdctMode::Fast, 0 },
+    { "ref", IdctMode::Reference, 1 },
+    { "ref-mt", IdctMode::Reference, 0 },
+};
+
+struct Row
+{
+    string mode, name;
+    int decodes{ 0 }, errors{ 0 };
+    double seconds{ 0 };
+    double bytes{ 0 }, pixels{ 0 };
+    vector<double> latencies; // seconds per decode
+    size_t peakRss{ 0 };
+
+    double Percentile(double p) const
+    {
+        if (latencies.empty())
+            return 0;
+        vector<double> sorted = latencies;
+        sort(sorted.begin(), sorted.end());
+        const size_t i = min(sorted.size() - 1, static_cast<size_t>(p * (sorted.size() - 1) + 0.5));
+        return sorted[i];
+    }
+};
+
+// start measuring the peak resident memory over again, where the OS allows
+void ResetPeakRss()
+{
+#if defined(__linux__)
+    ofstream("/proc/self/clear_refs") << "5"; // resets VmHWM
+#endif
+}
+
+// most bytes of memory resident at once
+size_t PeakRss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+#if defined(__linux__)
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.starts_with("VmHWM:"))
+            return stoull(line.substr(6)) * 1024;
+#endif
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss; // bytes
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+}
+
+// the generated part of the corpus, the sizes and samplings seen in practice
+vector<Input> SyntheticInputs()
+{
+    vector<SyntheticSpec> specs;
+    for (const auto& [w, h] : { pair{ 320, 240 }, pair{ 1280, 720 }, pair{ 1920, 1080 }, pair{ 4032, 3024 } })
+        specs.push_back({ .w = w, .h = h });
+    for (const auto& [hs, vs] : { pair{ 1, 1 }, pair{ 2, 1 }, pair{ 1, 2 } })
+        specs.push_back({ .w = 1920, .h = 1080, .hs = hs, .vs = vs });
+    specs.push_back({ .w = 1920, .h = 1080, .channels = 1 });
+    specs.push_back({ .w = 1920, .h = 1080, .quality = 50 });
+    specs.push_back({ .w = 1920, .h = 1080, .quality = 95 });
+    specs.push_back({ .w = 1920, .h = 1080, .restartInterval = 120 }); // a row of MCUs, decodes in parallel
+
+    vector<Input> inputs;
+    for (const auto& spec : specs)
+        inputs.push_back({ spec.Name(), "synthetic", MakeSyntheticJpeg(spec) });
+    return inputs;
+}
+
+vector<Input> FileInputs(const string& pathOrFilename)
+{
+    set<fs::path> sorted_by_name;
+    if (fs::is_regular_file(pathOrFilename))
+        sorted_by_name.insert(pathOrFilename);
+    else if (fs::is_directory(pathOrFilename))
+    {
+        for (auto& p : fs::recursive_directory_iterator(pathOrFilename))
+        {
+            const auto ext = p.path().extension();
+            if (ext == ".jpg" || ext == ".jpeg")
+                sorted_by_name.insert(p.path());
+        }
+    }
+    else
+        cout << format("{} not found, skipped\n", pathOrFilename);
+
+    vector<Input> inputs;
+    for (const auto& p : sorted_by_name)
+    {
+        MappedFile file(p.string());
+        const auto bytes = file.Bytes();
+        inputs.push_back({ p.string(), pathOrFilename, vector<uint8_t>(bytes.begin(), bytes.end()) });
+    }
+    return inputs;
+}
+
+// decode the inputs repeat times with a decoder set for the mode, one untimed pass first
+Row Run(const Mode& mode, const string& name, const vector<const Input*>& inputs, int repeat)
+{
+    Row row;
+    row.mode = mode.name;
+    row.name = name;
+
+    JpegDecoder dec;
+    dec.output = [](const string&) {};
+    dec.logLevel = LogType::ERROR;
+    ResetPeakRss();
+    for (int pass = -1; pass < repeat; ++pass)
+        for (const auto* input : inputs)
+        {
+            dec.Reset();
+            dec.idctMode = mode.idct;
+            dec.threads = mode.threads;
+            const auto start = chrono::steady_clock::now();
+            Decode(span<const uint8_t>(input->bytes), dec, input->name);
+            const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (pass < 0)
+                continue;
+
+            row.decodes++;
+            row.errors += dec.errorCount > 0;
+            row.seconds += seconds;
+            row.latencies.push_back(seconds);
+            row.bytes += input->bytes.size();
+            for (const auto& img : dec.images)
+                row.pixels += static_cast<double>(img->w) * img->h;
+        }
+    row.peakRss = PeakRss();
+    return row;
+}
+
+string CsvHeader() { return "mode,name,decodes,errors,seconds,mb_per_s,mpixels_per_s,p50_ms,p90_ms,p99_ms,max_ms,peak_rss_mb"; }
+
+string Csv(const Row& r)
+{
+    return format("{},\"{}\",{},{},{:.6f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f},{:.1f}",
+        r.mode, r.name, r.decodes, r.errors, r.seconds,
+        r.bytes / r.seconds / 1e6, r.pixels / r.seconds / 1e6,
+        r.Percentile(0.5) * 1e3, r.Percentile(0.9) * 1e3, r.Percentile(0.99) * 1e3, r.Percentile(1) * 1e3,
+        r.peakRss / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+    vector<string> paths, modeNames;
+    int repeat = 5;
+    bool synthetic = true, perFile = false;
+    string csvFilename;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc)
+            repeat = max(1, atoi(argv[++i]));
+        else if (arg == "--modes" && i + 1 < argc)
+        {
+            stringstream list(argv[++i]);
+            string m;
+            while (getline(list, m, ','))
+                modeNames.push_back(m);
+        }
+        else if (arg == "--no-synthetic")
+            synthetic = false;
+        else if (arg == "--files")
+            perFile = true;
+        else if (arg == "--csv" && i + 1 < argc)
+            csvFilename = argv[++i];
+        else if (arg.starts_with("--"))
+        {
+            cout << format("Unknown option {}\n", arg);
+            return 1;
+        }
+        else
+            paths.push_back(arg);
+    }
+    if (paths.empty())
+        paths = { "jpegtests", "HDR" };
+    if (modeNames.empty())
+        modeNames = { "fast", "fast-mt", "ref" };
+
+    vector<const Mode*> runModes;
+    for (const auto& m : modeNames)
+    {
+        const auto mode = find_if(begin(modes), end(modes), [&](const Mode& x) { return x.name == m; });
+        if (mode == end(modes))
+        {
+            cout << format("Unknown mode {}\n", m);
+            return 1;
+        }
+        runModes.push_back(mode);
+    }
+
+    vector<Input> corpus;
+    for (const auto& p : paths)
+        for (auto& input : FileInputs(p))
+            corpus.push_back(move(input));
+    if (synthetic)
+        for (auto& input : SyntheticInputs())
+            corpus.push_back(move(input));
+    if (corpus.empty())
+    {
+        cout << "No files to decode\n";
+        return 1;
+    }
+
+    // groups in corpus order, or each file alone
+    vector<pair<string, vector<const Input*>>> groups;
+    for (const auto& input : corpus)
+    {
+        const auto& key = perFile ? input.name : input.group;
+        if (groups.empty() || groups.back().first != key)
+            groups.push_back({ key, {} });
+        groups.back().second.push_back(&input);
+    }
+
+    double corpusBytes = 0;
+    for (const auto& input : corpus)
+        corpusBytes += input.bytes.size();
+    cout << format("{} files, {:.1f} MB, {} groups, {} timed passes, {} pool threads\n",
+        corpus.size(), corpusBytes / 1e6, groups.size(), repeat, ThreadPool::Shared().Size());
+
+    vector<Row> rows;
+    cout << format("{:<8} {:<40} {:>7} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9}\n",
+        "mode", "files", "decodes", "MB/s", "MP/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "RSS MB");
+    for (const auto* mode : runModes)
+        for (const auto& [name, inputs] : groups)
+        {
+            const auto r = Run(*mode, name, inputs, repeat);
+            cout << format("{:<8} {:<40} {:>7} {:>9.2f} {:>9.2f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.1f}{}\n",
+                r.mode, r.name.size() > 40 ? "..." + r.name.substr(r.name.size() - 37) : r.name, r.decodes,
+                r.bytes / r.seconds / 1e6, r.pixels / r.seconds / 1e6,
+                r.Percentile(0.5) * 1e3, r.Percentile(0.9) * 1e3, r.Percentile(0.99) * 1e3, r.Percentile(1) * 1e3,
+                r.peakRss / 1e6, r.errors ? format("  {} with errors", r.errors) : "");
+            rows.push_back(r);
+        }
+
+    if (!csvFilename.empty())
+    {
+        ofstream file(csvFilename);
+        file << CsvHeader() << "\n";
+        for (const auto& r : rows)
+            file << Csv(r) << "\n";
+        cout << format("CSV {} written\n", csvFilename);
+    }
+    return 0;
+}
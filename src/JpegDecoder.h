@@ -16,10 +16,23 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <span>
 #include <format>
 #include <numbers>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+
+#include "Kernels.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+#include "RestartIndex.h"
+#include "Arena.h"
+#include "DecodeStats.h"
 
 // optional decoders
 #include "ExifDec.h"
@@ -40,7 +53,7 @@ namespace Lomont::Jpeg
   3. add errors on unsupported things
   4. X warn on things not fully implemented
   5. fuzz across lots of jpegs
-  6. huff tree into lower memory - tree is sparse, linear array quite large
+  6. X huff tree into lower memory - now lookup tables
   7. add warning if file longer than read, meaning there may be more (or MPF files)
   8. add  Markers seen in a scan to implement
     FFC2 - Progressive DCT - too much work!
@@ -60,33 +73,215 @@ namespace Lomont::Jpeg
  */
     using namespace std;
 
+    // pixel rectangle
+    struct Rect
+    {
+        int x{ 0 }, y{ 0 }, w{ 0 }, h{ 0 };
+        bool Empty() const { return w <= 0 || h <= 0; }
+        bool Intersects(const Rect& r) const
+        {
+            return x < r.x + r.w && r.x < x + w && y < r.y + r.h && r.y < y + h;
+        }
+        Rect Intersect(const Rect& r) const
+        {
+            const int x0 = max(x, r.x), y0 = max(y, r.y);
+            const int x1 = min(x + w, r.x + r.w), y1 = min(y + h, r.y + r.h);
+            return { x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
+        }
+    };
+
+    // image pixel layout
+    enum class PixelFormat
+    {
+        RGB, // interleaved 8 bit RGB, chroma upsampled
+        BGR,
+        RGBA, // alpha is 255
+        BGRA,
+        Gray, // luma only, the Y samples as decoded
+        YCbCrPlanar // Y, Cb, Cr in planes at their coded sampling, no color conversion (I420 for 4:2:0)
+    };
+
+    // bytes per pixel of the interleaved formats, 0 for planar
+    inline int BytesPerPixel(PixelFormat format)
+    {
+        switch (format)
+        {
+        case PixelFormat::RGB:
+        case PixelFormat::BGR: return 3;
+        case PixelFormat::RGBA:
+        case PixelFormat::BGRA: return 4;
+        case PixelFormat::Gray: return 1;
+        default: return 0;
+        }
+    }
+
+    // store count RGB pixels as format
+    inline void StoreRgbRow(const uint8_t* rgb, uint8_t* dest, int count, PixelFormat format)
+    {
+        const bool bgr = format == PixelFormat::BGR || format == PixelFormat::BGRA;
+        const int bpp = BytesPerPixel(format);
+        for (int i = 0; i < count; ++i, rgb += 3, dest += bpp)
+        {
+            dest[0] = rgb[bgr ? 2 : 0];
+            dest[1] = rgb[1];
+            dest[2] = rgb[bgr ? 0 : 2];
+            if (bpp == 4)
+                dest[3] = 255;
+        }
+    }
+
     struct Image
     {
-        vector<uint8_t> data;
-        int w, h, channels;
-        void Resize(int w1, int h1, int ch)
+        vector<uint8_t> data; // pixels, empty when they are in caller memory or planes
+        int w, h, channels; // channels as coded, the pixel layout is format
+        int samplingH[4]{}, samplingV[4]{}; // per component, as coded
+        PixelFormat format{ PixelFormat::RGB };
+        int stride{ 0 }; // bytes from one pixel row to the next
+        uint8_t* external{ nullptr }; // caller owned pixels, not freed here
+
+        uint8_t* Row(int y) { return (external ? external : data.data()) + static_cast<size_t>(y) * stride; }
+        const uint8_t* Row(int y) const { return (external ? external : data.data()) + static_cast<size_t>(y) * stride; }
+        int PixelSize() const { return BytesPerPixel(format); }
+        // bytes of storage held, pixels and planes
+        size_t Capacity() const
+        {
+            size_t size = data.capacity();
+            for (const auto& p : planes)
+                size += p.capacity();
+            return size;
+        }
+
+        // planar output, one plane per component (Y only for gray), data is empty
+        vector<uint8_t> planes[3];
+        int planeW[3]{}, planeH[3]{};
+        int planeX[3]{}, planeY[3]{}; // plane origin in component samples, nonzero when cropped
+
+        void Resize(int w1, int h1, int ch, PixelFormat fmt = PixelFormat::RGB)
         {
             w = w1; h = h1; channels = ch;
-            data.resize(w * h * 3); // 3 channel RGB
+            format = fmt;
+            external = nullptr;
+            stride = w * PixelSize();
+            data.resize(static_cast<size_t>(stride) * h); // gray is one byte a pixel
+        }
+
+        // decode into caller memory, stride bytes apart, 0 for packed rows
+        // return false if the memory is too small, the image is unchanged
+        bool Attach(int w1, int h1, int ch, PixelFormat fmt, span<uint8_t> pixels, int rowStride = 0)
+        {
+            const int rowBytes = w1 * BytesPerPixel(fmt);
+            if (rowStride == 0)
+                rowStride = rowBytes;
+            if (pixels.data() == nullptr || rowBytes == 0 || rowStride < rowBytes ||
+                pixels.size() < static_cast<size_t>(rowStride) * (h1 - 1) + rowBytes)
+                return false;
+            w = w1; h = h1; channels = ch;
+            format = fmt;
+            stride = rowStride;
+            external = pixels.data();
+            data.clear();
+            return true;
+        }
+
+        // planar image of region r of the output, component c has hs[c]/hmax
+        // of the samples across and vs[c]/vmax down
+        void ResizePlanes(const Rect& r, int ch, const int hs[], const int vs[], int hmax, int vmax)
+        {
+            w = r.w; h = r.h; channels = ch;
+            format = PixelFormat::YCbCrPlanar;
+            external = nullptr;
+            stride = 0;
+            data.clear();
+            for (int c = 0; c < min(ch, 3); ++c)
+            {
+                planeX[c] = r.x * hs[c] / hmax;
+                planeY[c] = r.y * vs[c] / vmax;
+                planeW[c] = ((r.x + r.w) * hs[c] + hmax - 1) / hmax - planeX[c];
+                planeH[c] = ((r.y + r.h) * vs[c] + vmax - 1) / vmax - planeY[c];
+                planes[c].resize(static_cast<size_t>(planeW[c]) * planeH[c]);
+            }
         }
         void Set(int i, int j, int r, int g, int b)
         {
             if (0 <= i && 0 <= j && i < w && j < h)
             {
-                auto index = (i + j * w) * 3; // treat as grayscale, RGB
-                data[index + 0] = r;
-                data[index + 1] = g;
-                data[index + 2] = b;
+                const uint8_t rgb[3] = { static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b) };
+                StoreRgbRow(rgb, Row(j) + i * PixelSize(), 1, format);
+            }
+        }
+        // empty, storage is kept for the next Resize
+        void Clear()
+        {
+            data.clear();
+            w = h = channels = 0;
+            fill(begin(samplingH), end(samplingH), 0);
+            fill(begin(samplingV), end(samplingV), 0);
+            format = PixelFormat::RGB;
+            stride = 0;
+            external = nullptr;
+            for (int c = 0; c < 3; ++c)
+            {
+                planes[c].clear();
+                planeW[c] = planeH[c] = planeX[c] = planeY[c] = 0;
             }
         }
+
+        void SetGray(int i, int j, int v)
+        {
+            if (0 <= i && 0 <= j && i < w && j < h)
+                Row(j)[i] = v;
+        }
+    };
+
+
+
+    // bits of lookahead used by the Huffman decode tables
+    constexpr int HuffLookupBits = 9;
+
+    // huffman table, built from the DHT code counts and symbols
+    // codes of up to HuffLookupBits bits decode with one table lookup,
+    // longer codes use the canonical code ranges, jpeg spec Annex C and F.2.2.3
+    struct HuffTable
+    {
+        bool defined{ false };
+        uint8_t counts[17]{}; // number of codes of each length 1-16
+        uint8_t symbols[256]{}; // symbols in code order
+
+        int maxCode[17]{}; // largest code of each length, -1 if no codes that length
+        int valOffset[17]{}; // add to a code of that length to get index into symbols
+
+        // indexed by next HuffLookupBits bits: (code length << 8) | symbol, 0 if code longer
+        uint16_t lookup[1 << HuffLookupBits]{};
+
+        // indexed by next HuffLookupBits bits: when code and magnitude bits both fit,
+        // (coefficient << 8) | (zero run << 4) | total bit length, else 0
+        int16_t fastAc[1 << HuffLookupBits]{};
     };
 
+    // inverse DCT and color conversion path
+    enum class IdctMode
+    {
+        Fast, // separable integer IDCT, fixed point color conversion
+        Reference // original floating point IDCT, for comparing outputs
+    };
 
+    // zig-zag order (i,j) as nibbles
+    constexpr int zigzagOrder[64] =
+    {
+        0x00, 0x01, 0x10, 0x20, 0x11, 0x02, 0x03, 0x12, 0x21, 0x30, 0x40, 0x31, 0x22, 0x13, 0x04, 0x05,
+        0x14, 0x23, 0x32, 0x41, 0x50, 0x60, 0x51, 0x42, 0x33, 0x24, 0x15, 0x06, 0x07, 0x16, 0x25, 0x34,
+        0x43, 0x52, 0x61, 0x70, 0x71, 0x62, 0x53, 0x44, 0x35, 0x26, 0x17, 0x27, 0x36, 0x45, 0x54, 0x63,
+        0x72, 0x73, 0x64, 0x55, 0x46, 0x37, 0x47, 0x56, 0x65, 0x74, 0x75, 0x66, 0x57, 0x67, 0x76, 0x77
+    };
 
-    // huffman table, stored as array
-    // root index 1, left of i is 2*i, right is 2*i+1
-    // todo - these sparse, make in vector, each node has (value,left,right) index to next in array
-    using Tree = vector<short>;
+    // natural order index of each zigzag position
+    constexpr auto zigzagNatural = []
+        {
+            array<uint8_t, 64> n{};
+            for (int k = 0; k < 64; ++k)
+                n[k] = static_cast<uint8_t>((zigzagOrder[k] >> 4) * 8 + (zigzagOrder[k] & 0xF));
+            return n;
+        }();
 
     // tell how channel laid out
     struct ChDef
@@ -96,14 +291,175 @@ namespace Lomont::Jpeg
         int qTbl; // quant table
     };
 
+    // components and parameters of a scan, from SOS
+    struct ScanHeader
+    {
+        int count{ 0 }; // components in the scan
+        int comp[4]{}; // frame component index of each
+        int dcTbl[4]{}, acTbl[4]{}; // Huffman table ids
+        int ss{ 0 }, se{ 63 }; // spectral selection, zigzag range
+        int ah{ 0 }, al{ 0 }; // successive approximation, previous and current bit position
+    };
+
+    // coefficients of a progressive frame, built up over its scans
+    struct ProgressiveFrame
+    {
+        span<int16_t> coeffs[4]; // per component, 64 per block in natural order, not dequantized, from the arena
+        int blocksW[4]{}, blocksH[4]{}; // block grid of each component, whole MCUs
+        int scans{ 0 }; // scans decoded so far
+        int rendered{ 0 }; // scans in the image as last rendered, it is up to date when equal
+
+        int16_t* Block(int comp, int bx, int by)
+        {
+            return coeffs[comp].data() + (static_cast<size_t>(by) * blocksW[comp] + bx) * 64;
+        }
+        const int16_t* Block(int comp, int bx, int by) const
+        {
+            return coeffs[comp].data() + (static_cast<size_t>(by) * blocksW[comp] + bx) * 64;
+        }
+    };
+
+
+    // layout of the MCUs in a scan
+    struct ScanLayout;
+    struct McuState;
+
+    // puts the reconstructed samples of one MCU into the image, made for a sampling layout
+    using McuWriter = void (*)(const ScanLayout& layout, const McuState& state, Image& img, int destX, int destY, const IntKernels& kernels);
+
+    struct ScanLayout
+    {
+        int channels{ 0 };
+        int hmax{ 1 }, vmax{ 1 }; // max sampling factors
+        int hi[4]{}, vi[4]{}; // sampling sizes of ith component
+        int dcTbl[4]{}, acTbl[4]{}; // Huffman table ids of ith component, from the SOS
+        int mcuMaxH{ 0 }, mcuMaxV{ 0 }; // MCUs across and down
+        int mcuCount{ 0 };
+        int blocksPerMcu{ 0 }; // 8x8 blocks in one MCU, all components
+        int blockSize{ 8 }; // output size of a block, 8 / scale
+        bool reference{ false }; // double IDCT, only unscaled
+        Rect region; // output pixels wanted, image (0,0) is its corner
+        McuWriter writeMcu{ nullptr }; // picked for the sampling factors by MakeScanLayout
+
+        // pixels covered by an MCU
+        Rect McuRect(int mcuIndex) const
+        {
+            const int w = hmax * blockSize, h = vmax * blockSize;
+            return { (mcuIndex % mcuMaxH) * w, (mcuIndex / mcuMaxH) * h, w, h };
+        }
+    };
+
+    // working state for decoding a run of MCUs, one per thread
+    // buffers are carved from the decode arena, take one with ScopedMcuState
+    struct McuState
+    {
+        span<double> buffers[4]; // one buffer per component, used to hold one MCU
+        span<uint8_t> samples[4]; // same, for the fast integer path
+        span<int> coeffs; // entropy decoded blocks of one MCU, natural order
+        span<uint8_t> shapes; // per block of coeffs, see BlockShapeHigh
+        int lastDC[4]{}; // running DC offsets, used as deltas per MCU block
+        int marker{ 0 }; // the next restart marker to find
+        StatCounters counts; // work done with this state, for the decoder stats
+        span<uint8_t> memory; // all of the above, empty once the arena is reset
+
+        // size for a layout, zeroed, memory from before is reused when big enough
+        void Prepare(const ScanLayout& layout, Arena& arena)
+        {
+            auto align = [](size_t n) { return (n + 63) & ~size_t(63); };
+            size_t sizes[4]{};
+            size_t bytes = align(layout.blocksPerMcu * 64 * sizeof(int)) + align(layout.blocksPerMcu);
+            for (int i = 0; i < layout.channels; ++i)
+            {
+                if (layout.reference)
+                    sizes[i] = layout.hi[i] * layout.vi[i] * 64 * sizeof(double); // 8x8 per sampling block
+                else
+                    sizes[i] = layout.hi[i] * layout.vi[i] * layout.blockSize * layout.blockSize;
+                bytes += align(sizes[i]);
+            }
+            if (memory.size() < bytes)
+                memory = arena.Allocate<uint8_t>(bytes);
+            else
+                fill(memory.begin(), memory.end(), 0);
+
+            uint8_t* p = memory.data();
+            coeffs = span<int>(reinterpret_cast<int*>(p), layout.blocksPerMcu * 64);
+            p += align(coeffs.size_bytes());
+            shapes = span<uint8_t>(p, layout.blocksPerMcu);
+            p += align(shapes.size());
+            for (int i = 0; i < 4; ++i)
+            {
+                buffers[i] = {};
+                samples[i] = {};
+                if (i >= layout.channels)
+                    continue;
+                if (layout.reference)
+                    buffers[i] = span<double>(reinterpret_cast<double*>(p), sizes[i] / sizeof(double));
+                else
+                    samples[i] = span<uint8_t>(p, sizes[i]);
+                p += align(sizes[i]);
+            }
+            fill(begin(lastDC), end(lastDC), 0);
+            marker = 0;
+        }
+    };
+
+    // scratch memory of a decode, kept by a decoder for the next one
+    // McuStates are handed to each worker and given back when done, so the
+    // intervals and rows decoded in turn reuse the same few
+    class DecodeScratch
+    {
+    public:
+        Arena arena; // MCU states, pipeline coefficient slots, progressive coefficients
+
+        // counts are kept when there are stats, and added to them when given back
+        McuState* TakeState(const ScanLayout& layout, const DecodeStats* stats)
+        {
+            McuState* state = nullptr;
+            {
+                lock_guard<mutex> lock(m);
+                if (freeStates.empty())
+                {
+                    states.emplace_back(make_unique<McuState>());
+                    freeStates.push_back(states.back().get());
+                }
+                state = freeStates.back();
+                freeStates.pop_back();
+            }
+            state->Prepare(layout, arena);
+            state->counts = StatCounters{ stats != nullptr };
+            return state;
+        }
+
+        void GiveState(McuState* state, DecodeStats* stats)
+        {
+            lock_guard<mutex> lock(m);
+            if (stats)
+                stats->Add(state->counts);
+            freeStates.push_back(state);
+        }
+
+        // all arena memory is invalid after this, no state may be out
+        void Reset()
+        {
+            arena.Reset();
+            for (auto& s : states)
+                s->memory = {};
+        }
+
+    private:
+        mutex m;
+        vector<unique_ptr<McuState>> states;
+        vector<McuState*> freeStates;
+    };
+
 
     class JFIFDecoder : public Decoder
     {
     public:
-        bool Decode(Logger& dec, const vector<uint8_t>& data)
+        bool Decode(Logger& dec, span<const uint8_t> data)
         {
             this->dec = &dec;
-            this->data = &data;
+            this->data = data;
             isMoto = true; // endianess
 
 
@@ -114,9 +470,9 @@ namespace Lomont::Jpeg
             auto xThumbnail = read(1);
             auto yThumbnail = read(1);
             // n = x*y, then 3n 24 bit RGB
-            dec.logi(format(" - JFIF ver {:04X} units {} density {}x{} thumbnail {}x{}\n",
+            dec.logi(" - JFIF ver {:04X} units {} density {}x{} thumbnail {}x{}\n",
                 ver, units, xDensity, yDensity, xThumbnail, yThumbnail
-            ))
+            )
                 ;
             return true;
         }
@@ -128,7 +484,8 @@ namespace Lomont::Jpeg
     // jpeg decoder struct
     struct JpegDecoder : Logger
     {
-        vector<uint8_t> d;
+        span<const uint8_t> d; // bytes being decoded, not owned
+        shared_ptr<const MappedFile> input; // keeps d alive when decoding a file
         int offset;
         uint8_t read()
         {
@@ -139,8 +496,19 @@ namespace Lomont::Jpeg
         bool outOfData() const { return offset >= d.size(); }
 
         // Huffman tables
-        Tree tree[2][2]; // 0 = DC, 1 = AC, then 0 = Y, 1 = CbCr
+        HuffTable huffTables[2][4]; // 0 = DC, 1 = AC, then table id 0-3 (usually 0 = Y, 1 = CbCr)
         vector<uint16_t> qtbls[4]; // quantization tables
+        int32_t idctMul[4][64]{}; // quantization tables in natural order, folded into the integer IDCT
+
+        IdctMode idctMode{ IdctMode::Fast };
+        PixelFormat pixelFormat{ PixelFormat::RGB }; // planar is not streamed, onScanlines gets RGB then
+        // caller memory to decode into, called once the image size is known, return
+        // the pixels and set stride, in bytes, 0 for packed rows
+        // returning an empty span, or one too small, makes the image own its pixels
+        // not called for planar output or when streaming
+        function<span<uint8_t>(const Image& image, int& stride)> outputBuffer{ nullptr };
+        int scale{ 1 }; // output is 1/scale size, 1, 2, 4 or 8, done with reduced IDCTs
+        SimdLevel simdLevel{ DetectSimd() }; // highest SIMD level used by the Fast path, lower to compare
 
         // decoded images
         vector<shared_ptr<Image>> images;
@@ -152,23 +520,133 @@ namespace Lomont::Jpeg
         uint16_t seg;
 
         int channels{ 0 }; // 1 or 3
+        int frameWidth{ 0 }, frameHeight{ 0 }; // size as coded, images are this over scale
+
+        // region of interest in output pixels (after scale), empty for the whole image
+        // only MCUs touching it are reconstructed, images are its size
+        Rect crop;
+        Rect region; // the part of the scaled frame in the current image
         ChDef chdefs[4]; // usually 1 or 3 channels, CMYK rare 
+        ScanHeader scan; // the current scan
+
+        // progressive (SOF2) frames keep all coefficients, the image is made when it ends
+        bool progressive{ false };
+        ProgressiveFrame frame;
+        // progressive only, called after each scan with the image made from the
+        // coefficients so far, for early previews, not called when streaming
+        function<void(const Image& image, int scans)> onPreview{ nullptr };
 
         // decode interval, set with FFDD DRI marker, 
         // 0-65535, 0 means unused, can be reset in stream with a DRI of 0
         int decodeInterval{ 0 };
         int marker{ 0 }; // the next marker to find
 
+        // probe mode parses markers only, entropy coded data is skipped
+        bool probeOnly{ false };
+        bool incremental{ false }; // set by PushDecoder, which decodes or skips scans as their bytes arrive
+        vector<size_t> scanOffsets; // start of the entropy coded data of each scan
+        bool hasExif{ false }, hasIcc{ false }, hasXmp{ false }, hasMpf{ false }; // metadata seen
+
+        // threads for decoding restart intervals, 0 for one per core, 1 to decode serially
+        int threads{ 0 };
+
+        // streaming output, when set images get no pixels, instead each decoded
+        // MCU row is passed here as count scanlines starting at row y, packed in
+        // image.format, so memory is one MCU row of pixels; streamed scans decode serially
+        function<void(const Image& image, int y, int count, span<const uint8_t> pixels)> onScanlines{ nullptr };
+
+        // restart interval index, see RestartIndex.h
+        shared_ptr<const RestartIndex> restartIndex; // if it matches a scan, intervals are found without scanning
+        RestartIndex* indexOut{ nullptr }; // filled from the first scan with restart intervals
+
         // optional decoders
-        function<bool(Logger& logger, const vector<uint8_t>& data)> iccDecoder{ nullptr };
-        function<bool(Logger& logger, const vector<uint8_t>& data)> exifDecoder{ nullptr };
-        function<bool(Logger& logger, const vector<uint8_t>& data)> xmpDecoder{ nullptr };
-        function<bool(Logger& logger, const vector<uint8_t>& data)> mpfDecoder{ nullptr };
+        function<bool(Logger& logger, span<const uint8_t> data)> iccDecoder{ nullptr };
+        function<bool(Logger& logger, span<const uint8_t> data)> exifDecoder{ nullptr };
+        function<bool(Logger& logger, span<const uint8_t> data)> xmpDecoder{ nullptr };
+        function<bool(Logger& logger, span<const uint8_t> data)> mpfDecoder{ nullptr };
 
         // help debugging messages
         uint16_t currentMarkerCode;
         string currentMarkerText;
 
+        // memory kept between decodes, see Reset
+        unique_ptr<DecodeScratch> scratch{ make_unique<DecodeScratch>() };
+        vector<shared_ptr<Image>> spareImages; // images from before Reset held nowhere else, their storage is reused
+
+        // timings and counts of the decode when set, see DecodeStats.h
+        // Reset replaces it with a new one, so one held by the caller keeps its file
+        shared_ptr<DecodeStats> stats;
+
+        // ready for another file, keeping the settings (output, callbacks, scale,
+        // crop, formats, threads, ...) and the memory: the scratch arena, MCU states,
+        // and image storage the caller does not hold
+        // keepTables keeps the Huffman and quantization tables, for abbreviated
+        // streams that leave them out, jpeg spec B.4
+        void Reset(bool keepTables = false)
+        {
+            d = {};
+            input.reset();
+            offset = 0;
+            for (auto img = images.rbegin(); img != images.rend(); ++img) // first image last, taken first
+                if (img->use_count() == 1)
+                    spareImages.push_back(move(*img));
+            images.clear();
+            splitOffsets.clear();
+            hdr = UltraHdr();
+            lastCode = -1;
+            seg = 0;
+            channels = 0;
+            frameWidth = frameHeight = 0;
+            region = {};
+            for (auto& c : chdefs)
+                c = {};
+            scan = {};
+            progressive = false;
+            frame = {};
+            decodeInterval = 0;
+            marker = 0;
+            probeOnly = false;
+            incremental = false;
+            scanOffsets.clear();
+            hasExif = hasIcc = hasXmp = hasMpf = false;
+            restartIndex.reset();
+            indexOut = nullptr;
+            currentMarkerCode = 0;
+            currentMarkerText.clear();
+            verboseCount = infoCount = warningCount = errorCount = 0;
+            if (stats)
+                stats = make_shared<DecodeStats>();
+            if (!keepTables)
+            {
+                for (auto& tables : huffTables)
+                    for (auto& t : tables)
+                        t.defined = false;
+                for (auto& q : qtbls)
+                    q.clear();
+            }
+            scratch->Reset();
+        }
+    };
+
+    // an McuState from the decoder scratch, given back at the end of the scope
+    class ScopedMcuState
+    {
+    public:
+        ScopedMcuState(const JpegDecoder& dec, const ScanLayout& layout) :
+            scratch(*dec.scratch), stats(dec.stats.get()), state(scratch.TakeState(layout, stats))
+        {
+        }
+        ~ScopedMcuState() { scratch.GiveState(state, stats); }
+        ScopedMcuState(const ScopedMcuState&) = delete;
+        ScopedMcuState& operator=(const ScopedMcuState&) = delete;
+
+        McuState& operator*() const { return *state; }
+        McuState* operator->() const { return state; }
+
+    private:
+        DecodeScratch& scratch;
+        DecodeStats* stats;
+        McuState* state;
     };
 
 
@@ -189,106 +667,100 @@ namespace Lomont::Jpeg
         //offset += 64*(prec/2 + 1); // bytes // QT values
 
         // parse quant table(s)
-        for (int qt = 0; qt < len / 65; ++qt)
+        int remaining = len;
+        while (remaining > 0 && !dec.outOfData())
         {
             uint8_t b = dec.read(); // describe table
             int numQT = b & 15;       // 0-3, else error
             int prec = (b >> 4);      //*8+8; // 0 -> 8 bit, else 16 bit
-
+            remaining -= 1 + 64 * (prec == 0 ? 1 : 2);
 
             auto& q = dec.qtbls[numQT & 3];
+            q.clear(); // a redefined table id replaces the old table, later images (e.g. gain maps) use their own
 
             for (int i = 0; i < 64; i++)
-                q.push_back(dec.read());
+                q.push_back(prec == 0 ? dec.read() : read2(dec));
+
+            // integer IDCT multipliers, de-zigzagged
+            for (int k = 0; k < 64; ++k)
+            {
+                const auto coords = zigzagOrder[k];
+                dec.idctMul[numQT & 3][(coords >> 4) * 8 + (coords & 0xF)] = q[k];
+            }
         }
         return true;
     }
 
 
 
-    // store binary tree in array, root index 1
-    // left from i is 2*i, right from i is 2*i+1
-#define ROOT 1
-#define LEFT(k) (2*(k))
-#define RIGHT(k) (2*(k)+1)
-#define TOUCH(k) tree[(k)] = -2 // used, no value
-#define USED(k) (tree[(k)] != -1) // unused
-#define KIDS(k) TOUCH(LEFT(k)); TOUCH(RIGHT(k))
-#define PARENT(n) ((n)/2)
-
-// get rightmost node on level
-// return -1 if off tree
-    int RightLevelNode(const Tree& tree, int n)
+    // build the decode tables from the code counts and symbols
+    // return false if the counts do not describe a valid Huffman code
+    bool BuildHuffTable(HuffTable& table)
     {
-        if (n <= 0 || !USED(n)) return -1;
-
-        if (n != ROOT && LEFT(PARENT(n)) == n)
-            return RIGHT(PARENT(n));
-
-        // else walk up tree
-        int count = 0;
-        while (n != ROOT && RIGHT(PARENT(n)) == n)
+        // generate canonical codes, jpeg spec Annex C
+        uint16_t codes[256];
+        uint8_t sizes[256];
+        int code = 0, k = 0;
+        for (int len = 1; len <= 16; ++len)
         {
-            n = PARENT(n);
-            count++;
+            table.valOffset[len] = k - code;
+            for (int i = 0; i < table.counts[len]; ++i)
+            {
+                if (k >= 256 || code >= (1 << len))
+                    return false;
+                codes[k] = code++;
+                sizes[k++] = len;
+            }
+            table.maxCode[len] = table.counts[len] > 0 ? code - 1 : -1;
+            code <<= 1;
         }
-        if (n == ROOT) return -1; // at root, end of search
 
-        n = RIGHT(PARENT(n));
-
-        while (count > 0)
+        // lookahead tables
+        for (auto& e : table.lookup) e = 0;
+        for (auto& e : table.fastAc) e = 0;
+        for (int i = 0; i < k; ++i)
         {
-            n = LEFT(n);
-            count--;
+            const int len = sizes[i];
+            if (len > HuffLookupBits) break; // sizes increasing
+            const int shift = HuffLookupBits - len;
+            const int first = codes[i] << shift;
+            for (int j = 0; j < (1 << shift); ++j)
+                table.lookup[first + j] = static_cast<uint16_t>((len << 8) | table.symbols[i]);
         }
 
-        return n;
-    }
-
-    void DumpTree(const Tree& tree, int n = ROOT, int depth = 0)
-    {
-        for (n = ROOT; n < tree.size(); ++n)
+        // fold magnitude bits into a single lookup where they fit
+        for (int index = 0; index < (1 << HuffLookupBits); ++index)
         {
-            if (!USED(n))
-                continue;
-            auto left = LEFT(n), right = RIGHT(n);
-            auto lv = (left < tree.size()) ? tree[left] : -100;
-            auto rv = (right < tree.size()) ? tree[right] : -100;
-            cout << format("Node {} left {}={}, right {}={}\n", n, left, lv, right, rv);
+            const auto entry = table.lookup[index];
+            if (entry == 0) continue;
+            const int len = entry >> 8;
+            const int run = (entry >> 4) & 15;
+            const int bitLen = entry & 15;
+            if (bitLen == 0 || len + bitLen > HuffLookupBits)
+                continue; // EOB, ZRL, or too long
+            const int bits = (index >> (HuffLookupBits - len - bitLen)) & ((1 << bitLen) - 1);
+            const int value = bits < (1 << (bitLen - 1)) ? bits - (1 << bitLen) + 1 : bits;
+            if (-128 <= value && value <= 127)
+                table.fastAc[index] = static_cast<int16_t>(value * 256 + run * 16 + len + bitLen);
         }
-    }
-    // match JpegSnoop
-    void TreeLengths(const Tree& tree, vector<vector<int>>& data, int n = ROOT, int depth = 0)
-    {
-        if (tree[n] != -2)
-            data[depth].push_back(tree[n]);
-        auto left = LEFT(n), right = RIGHT(n);
-        if (left < tree.size() && USED(left))
-            TreeLengths(tree, data, left, depth + 1);
-        if (right < tree.size() && USED(right))
-            TreeLengths(tree, data, right, depth + 1);
+        return true;
     }
 
-    // dump codes of each length
-    void DumpTree2(const Tree& tree, JpegDecoder& dec)
+    // dump codes of each length, matches JpegSnoop
+    void DumpHuffTable(const HuffTable& table, JpegDecoder& dec)
     {
-        vector<vector<int>> data(17); // for each bit length 1-16, put codes here
-        TreeLengths(tree, data);
+        int index = 0;
         for (int len = 1; len <= 16; ++len)
         {
-
-            auto cnt = len < data.size() ? data[len].size() : 0;
-            auto s = format("   Codes of length {} bits ({} total):", len, cnt);
-
-            if (len < data.size())
-            {
-                for (auto v : data[len])
+            const int cnt = table.counts[len];
+            dec.logv([&]
                 {
-                    s += format(" {:02X}", v);
-                }
-            }
-            s += "\n";
-            dec.logv(s);
+                    auto s = format("   Codes of length {} bits ({} total):", len, cnt);
+                    for (int i = 0; i < cnt; ++i)
+                        s += format(" {:02X}", table.symbols[index + i]);
+                    return s + "\n";
+                });
+            index += cnt;
         }
     }
 
@@ -303,74 +775,45 @@ namespace Lomont::Jpeg
         int offset = dec.offset;
         auto len1 = read2(dec);
 
-        while (dec.offset - offset < len1)
+        while (dec.offset - offset < len1 && !dec.outOfData())
         {
             // 4 bit fields identify AC (1) or DC (0) and numeric id for table (0 or 1, 0=Y, 1 = color)
             // then 16 bytes for # of each length, then that many symbols (?)
             uint8_t b = dec.read();
-            int numHT = b & 7; // 0-3 used, else error
+            int numHT = b & 15; // 0-3 used, else error
             int ACDC = (b >> 4) & 1; // 0 = DC, 1 = AC
             // bits 5-7 should be 0
-            dec.logi(format("  AC {} num {}\n", ACDC, numHT));
-            auto& tree = dec.tree[ACDC][numHT];
+            dec.logi("  AC {} num {}\n", ACDC, numHT);
+            if (numHT > 3)
+                dec.logw("Huffman table id {} out of range 0-3\n", numHT);
+            auto& table = dec.huffTables[ACDC][numHT & 3];
 
             dec.logi("  tbl: ");
-            int len[16] = { 0 }, sum = 0, max = 0;
-            for (int i = 0; i < 16; i++)
+            int sum = 0;
+            table.counts[0] = 0;
+            for (int i = 1; i <= 16; i++)
             {
-                len[i] = dec.read();
-                dec.logi(format("{}:{} ", i+1,len[i]));
-                sum += len[i];
-                if (len[i] > 0)
-                    max = i + 1;
+                table.counts[i] = dec.read();
+                dec.logi("{}:{} ", i, table.counts[i]);
+                sum += table.counts[i];
             }
             dec.logi("\n");
 
-            tree.resize((1 << (max + 1)) + 1); // possible 2^max present nodes, +1 for 1 indexed
-            for (int j = 0; j < tree.size(); ++j)
+            if (sum > 256)
             {
-                tree[j] = -1; // unused
+                dec.loge("Huffman table has {} symbols, max 256\n", sum);
+                return false;
             }
-            TOUCH(ROOT); // root
-            KIDS(ROOT); // and children
-            int leftmost = LEFT(ROOT);
+            for (int i = 0; i < sum; ++i)
+                table.symbols[i] = dec.read(); // 0-255
 
-            for (int i = 0; i < max; ++i)
+            table.defined = BuildHuffTable(table);
+            if (!table.defined)
             {
-                if (len[i] == 0)
-                {
-                    auto current = leftmost;
-                    while (current > 0 && USED(current))
-                    {
-                        KIDS(current);
-                        current = RightLevelNode(tree, current);
-                    }
-                    leftmost = LEFT(leftmost);
-                }
-                else
-                {
-                    for (int j = 0; j < len[i]; ++j)
-                    {
-                        tree[leftmost] = dec.read(); // 0-255
-                        leftmost = RightLevelNode(tree, leftmost);
-                    }
-                    if (i != max - 1) // else done
-                    {
-                        KIDS(leftmost);
-                        auto current = RightLevelNode(tree, leftmost);
-                        leftmost = LEFT(leftmost);
-                        while (current >= ROOT && USED(current))
-                        {
-                            KIDS(current);
-                            current = RightLevelNode(tree, current);
-                        }
-                    }
-                }
-
-                //            cout << "Depth " << i << endl;
+                dec.loge("Huffman table code lengths invalid\n");
+                return false;
             }
-            //DumpTree(tree);
-            DumpTree2(tree, dec);
+            DumpHuffTable(table, dec);
         }
         return true;
     }
@@ -381,11 +824,60 @@ namespace Lomont::Jpeg
         auto len = read2(dec);
 
         auto bitsPerSample = dec.read(); // 8 bits, 12 and 16 not well supported
+        dec.progressive = dec.seg == 0xFFC2;
         int h = read2(dec); // pixel size
         int w = read2(dec);
         int channels = dec.read(); // 1 = gray, 3 = YCbCr or YIQ, 4 = CMYK rare
-        dec.GetImage()->Resize(w, h, channels);
-        dec.logi(format("   {}x{} {} channels, {} bits/sample\n", w, h, channels, bitsPerSample));
+        if (dec.scale != 1 && dec.scale != 2 && dec.scale != 4 && dec.scale != 8)
+        {
+            dec.logw("Scale {} not supported, using 1\n", dec.scale);
+            dec.scale = 1;
+        }
+        dec.frameWidth = w;
+        dec.frameHeight = h;
+        w = (w + dec.scale - 1) / dec.scale;
+        h = (h + dec.scale - 1) / dec.scale;
+
+        dec.region = { 0, 0, w, h };
+        if (!dec.crop.Empty())
+        {
+            const auto r = dec.crop.Intersect(dec.region);
+            if (r.Empty())
+                dec.logw("Crop {}x{} at {},{} is outside the {}x{} image, decoding all of it\n",
+                    dec.crop.w, dec.crop.h, dec.crop.x, dec.crop.y, w, h);
+            else
+            {
+                dec.region = r;
+                w = r.w;
+                h = r.h;
+                dec.logi("   cropped to {}x{} at {},{}\n", w, h, r.x, r.y);
+            }
+        }
+
+        auto img = dec.GetImage();
+        const bool planar = dec.pixelFormat == PixelFormat::YCbCrPlanar && !dec.probeOnly && !dec.onScanlines;
+        if (dec.pixelFormat == PixelFormat::YCbCrPlanar && dec.onScanlines)
+            dec.logw("Planar output is not streamed, streaming RGB\n");
+        const auto pixelFormat = dec.pixelFormat == PixelFormat::YCbCrPlanar ? PixelFormat::RGB : dec.pixelFormat;
+        img->format = pixelFormat;
+        img->w = w;
+        img->h = h;
+        img->channels = channels;
+        const size_t storage = img->Capacity();
+        // probe and streaming need the size only, planes are sized once sampling is known
+        if (!dec.probeOnly && !dec.onScanlines && !planar)
+        {
+            int stride = 0;
+            const auto pixels = dec.outputBuffer ? dec.outputBuffer(*img, stride) : span<uint8_t>();
+            if (pixels.empty())
+                img->Resize(w, h, channels, pixelFormat);
+            else if (!img->Attach(w, h, channels, pixelFormat, pixels, stride))
+            {
+                dec.logw("Output buffer of {} bytes, stride {}, too small for {}x{}, using own memory\n", pixels.size(), stride, w, h);
+                img->Resize(w, h, channels, pixelFormat);
+            }
+        }
+        dec.logi("   {}x{} {} channels, {} bits/sample\n", w, h, channels, bitsPerSample);
         if (dec.channels == 4)
             dec.loge("4 channel CMYK JPEG not supported\n");
 
@@ -401,13 +893,18 @@ namespace Lomont::Jpeg
             dec.chdefs[k].samplingH = t2 >> 4;
             dec.chdefs[k].samplingV = t2 & 15;
             dec.chdefs[k].qTbl = t3;
+            if (k < 4)
+            {
+                img->samplingH[k] = t2 >> 4;
+                img->samplingV[k] = t2 & 15;
+            }
             string ch = "";
             ch += t1;
             if (dec.channels != 4)
                 ch = chans[t1];
             assert(dec.channels == 4 || k == 0 || (t2 == 0x11)); // all chroma forms allowed look like nxn, 1x1, 1x1
             //   assert(dec.channels == 4 ||  dec.chdefs[k].samplingH == dec.chdefs[k].samplingV);// always true?
-            dec.logi(format("   - {}: {} sampling {}x{} qtbl {}\n", k, ch, (t2 >> 4), (t2 & 15), t3));
+            dec.logi("   - {}: {} sampling {}x{} qtbl {}\n", k, ch, (t2 >> 4), (t2 & 15), t3);
         }
         /* usual
          else decoder needs subsampling
@@ -417,12 +914,29 @@ namespace Lomont::Jpeg
               - 2: Cr sampling 1x1 qtbl 1
          */
 
+        if (planar && channels <= 4)
+        { // planes replace the RGB image
+            int hs[4]{}, vs[4]{}, hmax = 1, vmax = 1;
+            for (int k = 0; k < channels; ++k)
+            {
+                hs[k] = max(1, dec.chdefs[k].samplingH);
+                vs[k] = max(1, dec.chdefs[k].samplingV);
+                hmax = max(hmax, hs[k]);
+                vmax = max(vmax, vs[k]);
+            }
+            img->ResizePlanes(dec.region, channels, hs, vs, hmax, vmax);
+            dec.logi("   planar YCbCr output, Y {}x{}\n", img->planeW[0], img->planeH[0]);
+        }
+        if (dec.stats && img->Capacity() > storage)
+            dec.stats->Allocated(img->Capacity() - storage);
+
+        dec.frame = ProgressiveFrame(); // allocated by the first scan
         return dec.channels == 1 || dec.channels == 3; // disallow CMYK for now
     }
 
     // decode 8x8 block into decoding buffer
     // performs inverse DCT and stores float values
-    void InvertDCT(const int block[8][8], vector<double>& buffer, int mcuX, int mcuY, int mcuXMax)
+    void InvertDCT(const int block[8][8], span<double> buffer, int mcuX, int mcuY, int mcuXMax)
     {
         const double invsqrt2 = 1.0 / sqrt(2.0);
 
@@ -459,20 +973,32 @@ namespace Lomont::Jpeg
     }
 
     // decode MCU into final pixels
+    // SX and SY are the chroma subsampling of a common layout, luma has the
+    // largest factors and chroma is 1/SX as wide and 1/SY as tall, 0 for any layout
+    template<int SX, int SY>
     void DecodeMCU(
-        const vector<vector<double>>& buffers,
+        const span<double>(&buffers)[4],
         Image& img,
         int destX, int destY, // where to output in final image
         int srcW, int srcH, // src size
-        int hi[4], int vi[4], // per component scalings
+        const int hi[4], const int vi[4], // per component scalings
         int hmax, int vmax,
         int channels
     )
     {
         auto ReadPlane = [&](int p, int x, int y)
             {
-                int sx = (x * hi[p]) / hmax;
-                int sy = (y * vi[p]) / vmax;
+                int sx, sy;
+                if constexpr (SX == 0)
+                {
+                    sx = (x * hi[p]) / hmax;
+                    sy = (y * vi[p]) / vmax;
+                }
+                else
+                {
+                    sx = p == 0 ? x : x / SX;
+                    sy = p == 0 ? y : y / SY;
+                }
                 int index = sx + sy * hi[p] * 8;
                 return buffers[p][index];
             };
@@ -495,18 +1021,140 @@ namespace Lomont::Jpeg
                 R = std::clamp(R, 0, 255);
                 G = std::clamp(G, 0, 255);
                 B = std::clamp(B, 0, 255);
-                img.Set(x + destX, y + destY, R, G, B);
+                if (img.format == PixelFormat::Gray)
+                    img.SetGray(x + destX, y + destY, std::clamp(static_cast<int>(std::round(Y)), 0, 255));
+                else
+                    img.Set(x + destX, y + destY, R, G, B);
+            }
+    }
+
+    // decode MCU of 8 bit samples into final pixels, a row at a time
+    // samples are level shifted, chroma centered on 128
+    // SX and SY as the double version, the common layouts need no divides
+    template<int SX, int SY>
+    void DecodeMCU(
+        const span<uint8_t>(&samples)[4],
+        Image& img,
+        int destX, int destY, // where to output in final image, may be partly outside
+        int srcW, int srcH, // src size
+        const int hi[4], const int vi[4], // per component scalings
+        int hmax, int vmax,
+        int channels,
+        const IntKernels& kernels
+    )
+    {
+        // clip to image
+        const int x0 = max(0, -destX), y0 = max(0, -destY);
+        const int w = min(srcW, img.w - destX);
+        const int h = min(srcH, img.h - destY);
+        if (w <= x0 || h <= y0) return;
+
+        // planes replicated up to MCU width, at most 4*8 pixels
+        uint8_t rows[3][32];
+        const uint8_t* planes[3];
+        if (channels < 3)
+        {
+            memset(rows[1], 128, w); // gray, no chroma
+            planes[1] = planes[2] = rows[1];
+        }
+
+        for (auto y = y0; y < h; ++y)
+        {
+            for (int p = 0; p < min(channels, 3); ++p)
+            {
+                if constexpr (SX == 0)
+                {
+                    const int sy = (y * vi[p]) / vmax;
+                    const uint8_t* src = samples[p].data() + sy * (srcW * hi[p] / hmax);
+                    if (hi[p] == hmax)
+                        planes[p] = src;
+                    else
+                    {
+                        for (auto x = x0; x < w; ++x)
+                            rows[p][x] = src[(x * hi[p]) / hmax];
+                        planes[p] = rows[p];
+                    }
+                }
+                else if (p == 0 || SX == 1)
+                    planes[p] = samples[p].data() + (p == 0 ? y * srcW : y / SY * (srcW / SX));
+                else
+                {
+                    const uint8_t* src = samples[p].data() + y / SY * (srcW / SX);
+                    for (auto x = x0; x < w; ++x)
+                        rows[p][x] = src[x / SX];
+                    planes[p] = rows[p];
+                }
+            }
+            uint8_t* dest = img.Row(destY + y) + (destX + x0) * img.PixelSize();
+            if (img.format == PixelFormat::RGB)
+                kernels.colorRow(planes[0] + x0, planes[1] + x0, planes[2] + x0, dest, w - x0);
+            else if (img.format == PixelFormat::Gray)
+                memcpy(dest, planes[0] + x0, w - x0); // luma is Y, no conversion
+            else
+            {
+                uint8_t rgb[32 * 3];
+                kernels.colorRow(planes[0] + x0, planes[1] + x0, planes[2] + x0, rgb, w - x0);
+                StoreRgbRow(rgb, dest, w - x0, img.format);
             }
+        }
+    }
+
+    // the image writer of ReconstructMcu for one sampling layout, SX and SY as DecodeMCU
+    template<int SX, int SY>
+    void WriteMcu(const ScanLayout& layout, const McuState& state, Image& img, int destX, int destY, const IntKernels& kernels)
+    {
+        if (layout.reference)
+            DecodeMCU<SX, SY>(
+                state.buffers,
+                img,
+                destX, destY,
+                layout.hmax * 8, layout.vmax * 8,
+                layout.hi, layout.vi,
+                layout.hmax, layout.vmax,
+                layout.channels
+            );
+        else
+            DecodeMCU<SX, SY>(
+                state.samples,
+                img,
+                destX, destY,
+                layout.hmax * layout.blockSize, layout.vmax * layout.blockSize,
+                layout.hi, layout.vi,
+                layout.hmax, layout.vmax,
+                layout.channels,
+                kernels
+            );
     }
 
     struct BitReader
     {
-        int bitPos{ 0 }; // bits left in byte
-        uint8_t byte;
+        uint64_t bits{ 0 }; // bit accumulator, next bit in the msb
+        int bitCount{ 0 }; // valid bits in accumulator
         int lastCode{ -1 };
-        JpegDecoder* dec{ nullptr };
+        Logger* dec{ nullptr }; // messages go here
         bool done{ false };
 
+        // entropy coded bytes, read position is independent of the decoder so
+        // several readers can work on one scan
+        const uint8_t* data{ nullptr };
+        size_t size{ 0 };
+        size_t pos{ 0 };
+
+        void Start(Logger& logger, span<const uint8_t> d, size_t offset)
+        {
+            dec = &logger;
+            data = d.data();
+            size = d.size();
+            pos = offset;
+        }
+        bool outOfData() const { return pos >= size; }
+
+        // a marker stops the fill, zero bits are fed after it
+        bool markerHit{ false };
+        int markerCode{ -1 };
+        int padBits{ 0 }; // zero bits appended past the marker
+        bool starved{ false }; // stopped at the end of the data, not at a marker
+
         // read till next marker
         // return if successful
         bool readMarker(int markerIndex)
@@ -515,20 +1163,22 @@ namespace Lomont::Jpeg
 
             auto marker = 0xFFD0 + markerIndex;
 
-            dec->logv(format("Seeking reset marker {}...", markerIndex));
-            // flush out current byte
-            while (bitPos > 0)
-                readOne();
+            dec->logv("Seeking reset marker {}...", markerIndex);
+            // flush out current byte, and any lookahead (can only be padding before the marker)
+            bits = 0;
+            bitCount = 0;
+            padBits = 0;
+            markerHit = false;
 
             // read till code passed
             bool found = false;
-            while (!found && !dec->outOfData())
+            while (!found && !outOfData())
             {
                 int b = -1;
-                do { b = dec->read(); } while (b != 0xFF && !dec->outOfData());
-                if (b == 0xFF && !dec->outOfData())
+                do { b = data[pos++]; } while (b != 0xFF && !outOfData());
+                if (b == 0xFF && !outOfData())
                 {
-                    int b = dec->read();
+                    int b = data[pos++];
                     found = b == 0xD0 + markerIndex;
 
                 }
@@ -541,137 +1191,1124 @@ namespace Lomont::Jpeg
             }
             else
             {
+                starved = true;
                 dec->logi("did not find!\n");
                 return false;
             }
         }
 
-        int readOne()
+        // make at least 57 bits available in the accumulator
+        // bulk path takes whole 8 byte words when they hold no 0xFF,
+        // byte path handles stuffed 0xFF00 and stops at a marker
+        void fill()
+        {
+            while (bitCount <= 56)
+            {
+                if (!markerHit && pos + 8 <= size)
+                {
+                    const uint8_t* p = data + pos;
+                    uint64_t word = 0;
+                    for (int i = 0; i < 8; ++i)
+                        word = (word << 8) | p[i];
+
+                    // bytes that fit, any 0xFF among them takes the byte path
+                    const int n = (64 - bitCount) >> 3;
+                    const uint64_t mask = n == 8 ? ~0ULL : ~(~0ULL >> (8 * n));
+                    const uint64_t x = ~word | ~mask; // 0xFF bytes become 0
+                    const bool hasFF = ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+                    if (!hasFF)
+                    {
+                        bits |= (word & mask) >> bitCount;
+                        bitCount += 8 * n;
+                        pos += n;
+                        continue;
+                    }
+                }
+                fillByte();
+            }
+        }
+
+        // add one byte to the accumulator
+        void fillByte()
+        {
+            int b = 0;
+            if (!markerHit)
+            {
+                if (outOfData() || (data[pos] == 0xFF && pos + 1 >= size))
+                {
+                    markerHit = true; // no more data, treat as marker
+                    starved = true;
+                }
+                else
+                {
+                    b = data[pos];
+                    // byte stuffing should follow any 0xFF with 0x00, if not, it is a marker
+                    if (b == 0xFF)
+                    {
+                        const int nxt = data[pos + 1];
+                        if (nxt != 0x00)
+                        {
+                            // leave the marker unread, feed zeros after it
+                            markerCode = 0xFF00 + nxt;
+                            markerHit = true;
+                            b = 0;
+                        }
+                        else
+                            pos += 2;
+                    }
+                    else
+                        pos++;
+                }
+            }
+            if (markerHit)
+                padBits += 8;
+            bits |= static_cast<uint64_t>(b) << (56 - bitCount);
+            bitCount += 8;
+        }
+
+        // next n bits, 1 <= n <= 16, without consuming them
+        // jpeg never needs more, and more than 31 would not fit the int
+        int peek(int n)
+        {
+            assert(1 <= n && n <= 16);
+            if (bitCount < n)
+                fill();
+            return static_cast<int>(bits >> (64 - n));
+        }
+
+        // consume n bits, 0 <= n <= 32
+        void skip(int n)
+        {
+            if (bitCount < n)
+                fill();
+            bits <<= n;
+            bitCount -= n;
+            if (bitCount < padBits && !done)
+            {
+                // ran into the marker
+                lastCode = markerCode;
+                if (markerCode == -1)
+                    dec->loge("Compressed data ended early\n");
+                else
+                    dec->loge("0x{:04X} token in compressed decode, unsupported\n", lastCode);
+                done = true;
+            }
+        }
+
+        // read n bits, 1 <= n <= 16, as peek
+        int getBits(int n)
+        {
+            const auto v = peek(n);
+            skip(n);
+            return v;
+        }
+
+        int next1() {
+            return getBits(1);
+        }
+
+        // read bitLen magnitude bits, extend to signed value, jpeg spec F.2.2.1
+        // leading bit 1 is positive, else value is bits - (2^bitLen - 1)
+        int read1(int bitLen)
+        {
+            if (bitCount < bitLen)
+                fill();
+            const int raw = static_cast<int>((bits >> 1) >> (63 - bitLen)); // 0 when bitLen is 0
+            const int positive = static_cast<int>(static_cast<int64_t>(bits) >> 63); // -1 if leading bit set
+            const int bias = static_cast<int>(~0U << bitLen) + 1;
+            skip(bitLen);
+            return raw + (bias & ~positive);
+        }
+    };
+
+    // return the next symbol, or -1 for an invalid code
+    int DecodeHuffman(BitReader& br, const HuffTable& table)
+    {
+        const auto entry = table.lookup[br.peek(HuffLookupBits)];
+        if (entry != 0)
+        {
+            br.skip(entry >> 8);
+            return entry & 255;
+        }
+
+        // longer code, find length where it fits the canonical range
+        const int code16 = br.peek(16);
+        for (int len = HuffLookupBits + 1; len <= 16; ++len)
+        {
+            const int code = code16 >> (16 - len);
+            if (code <= table.maxCode[len])
+            {
+                br.skip(len);
+                return table.symbols[code + table.valOffset[len]];
+            }
+        }
+        return -1;
+    }
+
+
+    string DumpPrefix(JpegDecoder& dec, span<const uint8_t> buffer, bool logData = true)
+    {
+        int len = buffer.size();
+        if (len > 50) len = 50;
+        string prefix;
+        bool inPrefix = true;
+        string s = "Data: ";
+        for (auto i = 0; i < len; ++i)
+        {
+            char c = buffer[i];
+            if (c < 32 || 127 < c) {
+                inPrefix = false;
+                c = '.';
+            }
+            s += c;
+            if (inPrefix)
+                prefix += c;
+        }
+        s += "\n";
+        if (logData)
+			dec.logi(s);
+        return prefix;
+    }
+
+
+    // entropy decode one MCU into coeffs, blocks in component order, natural order, not dequantized
+    // shapes has one entry per block, and must match the blocks from their last
+    // use, only coefficients they allow are cleared, all zero on fresh memory
+    // a restart marker after the MCU is read from the stream unless it is the last one
+    // return false on a fatal error
+    bool DecodeMcuCoeffs(const JpegDecoder& dec, Logger& log, BitReader& br, const ScanLayout& layout, McuState& state, int* coeffs, uint8_t* shapes, int mcuIndex, int last)
+    {
+        // component ordering in jpeg spec, A.2.3
+        // a Minimum Coded Unit is a set of 8x8 blocks that make a minimal
+        // size for the various sample sizes (helps minimize mem requirements for decoding)
+
+        // 1/8 scale needs only DC, AC codes are consumed but not reconstructed
+        const bool dcOnly = layout.blockSize == 1;
+        const int64_t start = state.counts.on ? StatClock() : 0;
+
+        log.logv("Decoding MCU-{}/{}\n", mcuIndex + 1, layout.mcuCount);
+        for (auto compID = 0; compID < layout.channels; ++compID)
+        {
+            const int blocks = layout.hi[compID] * layout.vi[compID];
+            const auto& dcTbl = dec.huffTables[0][layout.dcTbl[compID]];
+            const auto& acTbl = dec.huffTables[1][layout.acTbl[compID]];
+            for (int b = 0; b < blocks; ++b, coeffs += 64, ++shapes)
+            {
+                // decode 1 DC and 63 AC coeffs
+
+                // clear what the block held before, DC is overwritten
+                if (*shapes & BlockShapeHigh)
+                    memset(coeffs, 0, 64 * sizeof(int));
+                else if (*shapes != 0)
+                    for (int r = 0; r < 4; ++r)
+                        memset(coeffs + r * 8, 0, 4 * sizeof(int));
+                *shapes = BlockShapeFull; // until the block is complete
+                int shape = 0;
+
+                // DC coeff, symbol is bit length of the difference
+                const auto dcLen = DecodeHuffman(br, dcTbl);
+                if (dcLen < 0)
+                {
+                    log.loge("Invalid Huffman code in MCU {}\n", mcuIndex);
+                    return false;
+                }
+                const int dcDiff = br.read1(dcLen & 0x0F);
+
+                // AC coeffs
+                int coeffCount = 1;
+                bool overrun = false;
+                while (coeffCount < 64)
+                {
+                    // short code and magnitude in one lookup
+                    const auto fast = acTbl.fastAc[br.peek(HuffLookupBits)];
+                    if (fast != 0)
+                    {
+                        br.skip(fast & 15);
+                        coeffCount += (fast >> 4) & 15; // append zeros
+                        if (coeffCount > 63) { overrun = true; break; }
+                        if (!dcOnly)
+                        {
+                            const int n = zigzagNatural[coeffCount];
+                            coeffs[n] = fast >> 8;
+                            shape |= n;
+                        }
+                        ++coeffCount;
+                        continue;
+                    }
+
+                    auto value = DecodeHuffman(br, acTbl);
+                    if (value < 0)
+                    {
+                        log.loge("Invalid Huffman code in MCU {}\n", mcuIndex);
+                        return false;
+                    }
+
+                    int zeroCount = value >> 4;
+                    int bitLen = value & 0x0F;
+                    if (bitLen == 0 && zeroCount != 15)
+                        break; // EOB, rest are 0
+
+                    coeffCount += zeroCount; // append zeros, ZRL is 16 zeros
+                    if (coeffCount > 63) { overrun = true; break; }
+                    if (dcOnly)
+                        br.skip(bitLen);
+                    else if (bitLen != 0)
+                    {
+                        const int n = zigzagNatural[coeffCount];
+                        coeffs[n] = br.read1(bitLen);
+                        shape |= n;
+                    }
+                    ++coeffCount;
+                }
+                if (overrun)
+                {
+                    log.loge("Coefficient run past end of block in MCU {}\n", mcuIndex);
+                    return false;
+                }
+                state.counts.zeroBlocks += shape == 0;
+
+                // DC_i = DC_i-1 + DC-difference
+                state.lastDC[compID] += dcDiff;
+                coeffs[0] = state.lastDC[compID];
+                *shapes = static_cast<uint8_t>(shape);
+            } // MCU x and y units
+        } // components
+
+        // restart markers?
+        if (dec.decodeInterval && (mcuIndex + 1) % dec.decodeInterval == 0 && mcuIndex + 1 < last)
+        {
+            auto found = br.readMarker(state.marker);
+            if (!found)
+            {
+                log.loge("Error trying to get restart marker {} at MCU {} out of {} MCUs, step size {}\n",
+                    state.marker, mcuIndex, layout.mcuCount, dec.decodeInterval
+                );
+                return false;
+
+            }
+            state.marker = (state.marker + 1) & 7;
+            for (auto& dc : state.lastDC)
+                dc = 0;
+        }
+        if (state.counts.on)
+        {
+            state.counts.entropyNs += StatClock() - start;
+            ++state.counts.mcus;
+            state.counts.blocks += layout.blocksPerMcu;
+        }
+        return true;
+    }
+
+    // copy the component samples of an MCU into the image planes, clipped to them
+    // no upsampling or color conversion, the reference path rounds its doubles
+    void WritePlanes(const ScanLayout& layout, const McuState& state, const Rect& mcuRect, Image& img)
+    {
+        for (int c = 0; c < min(layout.channels, 3); ++c)
+        {
+            const int hi = layout.hi[c], vi = layout.vi[c];
+            const int srcW = hi * (layout.reference ? 8 : layout.blockSize);
+            const int srcH = vi * (layout.reference ? 8 : layout.blockSize);
+            // MCU origin in component samples, relative to the plane
+            const int px = mcuRect.x * hi / layout.hmax - img.planeX[c];
+            const int py = mcuRect.y * vi / layout.vmax - img.planeY[c];
+            const int x0 = max(0, -px), x1 = min(srcW, img.planeW[c] - px);
+            const int y0 = max(0, -py), y1 = min(srcH, img.planeH[c] - py);
+            if (x1 <= x0) continue;
+            for (int y = y0; y < y1; ++y)
+            {
+                uint8_t* dst = img.planes[c].data() + static_cast<size_t>(py + y) * img.planeW[c] + px;
+                if (layout.reference)
+                {
+                    const double* src = state.buffers[c].data() + y * srcW;
+                    for (int x = x0; x < x1; ++x)
+                        dst[x] = static_cast<uint8_t>(clamp(static_cast<int>(std::round(src[x] + 128)), 0, 255));
+                }
+                else
+                    memcpy(dst + x0, state.samples[c].data() + y * srcW + x0, x1 - x0);
+            }
+        }
+    }
+
+    // dequantize, invert and color convert one entropy decoded MCU into the image
+    // img holds output rows from top on, a planar image gets the samples as they are
+    // shapes per block pick the cheapest IDCT giving the same samples
+    void ReconstructMcu(const JpegDecoder& dec, const ScanLayout& layout, McuState& state, const int* coeffs, const uint8_t* shapes, int mcuIndex, Image& img, const IntKernels& kernels, int top = 0)
+    {
+        const int* hi = layout.hi;
+        const int* vi = layout.vi;
+        const int bs = layout.blockSize;
+
+        // outside the region of interest, only the entropy decode was needed
+        const auto mcuRect = layout.McuRect(mcuIndex);
+        if (!mcuRect.Intersects(layout.region))
+            return;
+        const int64_t start = state.counts.on ? StatClock() : 0;
+
+        for (auto compID = 0; compID < layout.channels; ++compID)
+        {
+            const int qIndex = dec.chdefs[compID].qTbl & 3;
+            for (auto mcuY = 0; mcuY < vi[compID]; ++mcuY)
+                for (auto mcuX = 0; mcuX < hi[compID]; ++mcuX, coeffs += 64, ++shapes)
+                {
+                    if (layout.reference)
+                    {
+                        // apply quantize
+                        int block[8][8];
+                        const auto& qTbl = dec.qtbls[qIndex];
+                        for (int k = 0; k < 64; ++k)
+                        {
+                            const auto coords = zigzagOrder[k];
+                            block[coords >> 4][coords & 0xF] = coeffs[(coords >> 4) * 8 + (coords & 0xF)] * qTbl[k];
+                        }
+
+                        // invert 8x8 DCT block into real valued MCU component buffer
+                        InvertDCT(block, state.buffers[compID], mcuX, mcuY, hi[compID]);
+                    }
+                    else
+                    {
+                        // invert 8x8 DCT block into 8 bit MCU component buffer, quantize is folded into the IDCT
+                        // scaled decodes make a smaller block
+                        const int stride = hi[compID] * bs;
+                        const auto idct = *shapes == 0 ? kernels.idctDc : (*shapes & BlockShapeHigh) == 0 ? kernels.idctLow : kernels.idct;
+                        idct(coeffs, dec.idctMul[qIndex], state.samples[compID].data() + mcuX * bs + mcuY * bs * stride, stride);
+                    }
+                }
+        }
+
+        int64_t idctEnd = 0;
+        if (state.counts.on)
+        {
+            idctEnd = StatClock();
+            state.counts.idctNs += idctEnd - start;
+        }
+
+        const int destX = mcuRect.x - layout.region.x;
+        const int destY = mcuRect.y - layout.region.y - top;
+
+        // decode MCU into final pixels
+        if (img.format == PixelFormat::YCbCrPlanar)
+            WritePlanes(layout, state, mcuRect, img);
+        else
+            layout.writeMcu(layout, state, img, destX, destY, kernels);
+        if (state.counts.on)
+            state.counts.colorNs += StatClock() - idctEnd;
+    }
+
+    // decode MCUs [first,last) from the bit reader into the image
+    // restart markers between MCUs are read from the stream
+    // return false on a fatal error
+    bool DecodeMcus(const JpegDecoder& dec, Logger& log, BitReader& br, const ScanLayout& layout, McuState& state, Image& img, int first, int last)
+    {
+        const auto kernels = GetKernels(dec.simdLevel, dec.scale);
+        for (int mcuIndex = first; mcuIndex < last; ++mcuIndex)
+        {
+            if (!DecodeMcuCoeffs(dec, log, br, layout, state, state.coeffs.data(), state.shapes.data(), mcuIndex, last))
+                return false;
+            ReconstructMcu(dec, layout, state, state.coeffs.data(), state.shapes.data(), mcuIndex, img, kernels);
+        } // end of all MCU decoded
+        return true;
+    }
+
+    // entropy decode and reconstruct MCU row mcuY, img holds output rows from top on
+    // last is one past the final MCU decoded in the scan
+    // return false on a fatal error
+    bool DecodeMcuRow(const JpegDecoder& dec, Logger& log, BitReader& br, const ScanLayout& layout, McuState& state, Image& img, const IntKernels& kernels, int mcuY, int last, int top)
+    {
+        const int first = mcuY * layout.mcuMaxH;
+        for (int mcuIndex = first; mcuIndex < first + layout.mcuMaxH; ++mcuIndex)
+        {
+            if (!DecodeMcuCoeffs(dec, log, br, layout, state, state.coeffs.data(), state.shapes.data(), mcuIndex, last))
+                return false;
+            ReconstructMcu(dec, layout, state, state.coeffs.data(), state.shapes.data(), mcuIndex, img, kernels, top);
+        }
+        return true;
+    }
+
+    // pass the image rows in a band of output rows from top on to dec.onScanlines
+    // rows above a crop have nothing to send
+    void SendScanlines(const JpegDecoder& dec, const Image& img, const Image& band, int top)
+    {
+        const int y0 = max(0, top), y1 = min(img.h, top + band.h);
+        if (y0 < y1)
+        {
+            StatTimer timer(dec.stats.get(), StatPhase::Output);
+            const size_t lineBytes = band.stride;
+            dec.onScanlines(img, y0, y1 - y0, span<const uint8_t>(band.data).subspan((y0 - top) * lineBytes, (y1 - y0) * lineBytes));
+        }
+    }
+
+    // decode the first rows MCU rows into a band one MCU row high, passing
+    // each finished band to dec.onScanlines
+    // return false on a fatal error
+    bool DecodeMcusStreaming(const JpegDecoder& dec, Logger& log, BitReader& br, const ScanLayout& layout, McuState& state, const Image& img, int rows)
+    {
+        const auto kernels = GetKernels(dec.simdLevel, dec.scale);
+        const int mcuH = layout.vmax * layout.blockSize;
+        Image band;
+        band.Resize(img.w, mcuH, img.channels, img.format);
+
+        for (int mcuY = 0; mcuY < rows; ++mcuY)
+        {
+            const int top = mcuY * mcuH - layout.region.y; // output row of the band start
+            const bool ok = DecodeMcuRow(dec, log, br, layout, state, band, kernels, mcuY, rows * layout.mcuMaxH, top);
+            SendScanlines(dec, img, band, top); // a failed row sends what decoded
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    // reconstruction threads for the pipeline, more do not keep up with one entropy decoder
+    constexpr int PipelineHelpers = 3;
+
+    // two stage pipeline for a scan that cannot be split at restart markers
+    // the calling thread entropy decodes MCU rows into a ring of coefficient
+    // slots, pool threads (and the caller when it is waiting) reconstruct them
+    // decodes the first rows MCU rows
+    // return false on a fatal error
+    bool DecodeMcusPipelined(const JpegDecoder& dec, Logger& log, BitReader& br, const ScanLayout& layout, McuState& state, Image& img, int rows, int helpers)
+    {
+        const auto kernels = GetKernels(dec.simdLevel, dec.scale);
+        const int rowBlocks = layout.mcuMaxH * layout.blocksPerMcu;
+        const int rowCoeffs = rowBlocks * 64;
+
+        struct Row
+        {
+            int slot, first, last; // MCUs [first,last) in the slot
+        };
+        struct Pipeline
+        {
+            mutex m;
+            condition_variable cv;
+            deque<Row> ready; // rows waiting for reconstruction
+            vector<int> freeSlots;
+            int busy{ 0 }; // rows being reconstructed
+            bool finished{ false }; // no more rows coming
+        };
+        auto pipe = make_shared<Pipeline>();
+        const int slots = 2 * helpers + 2;
+        const auto coeffs = dec.scratch->arena.Allocate<int>(static_cast<size_t>(slots) * rowCoeffs);
+        const auto shapes = dec.scratch->arena.Allocate<uint8_t>(static_cast<size_t>(slots) * rowBlocks);
+        for (int s = 0; s < slots; ++s)
+            pipe->freeSlots.push_back(s);
+
+        auto reconstruct = [&](const Row& row, McuState& st)
+            {
+                const int* c = coeffs.data() + static_cast<size_t>(row.slot) * rowCoeffs;
+                const uint8_t* sh = shapes.data() + static_cast<size_t>(row.slot) * rowBlocks;
+                for (int mcuIndex = row.first; mcuIndex < row.last; ++mcuIndex, c += layout.blocksPerMcu * 64, sh += layout.blocksPerMcu)
+                    ReconstructMcu(dec, layout, st, c, sh, mcuIndex, img, kernels);
+            };
+
+        // take a ready row and reconstruct it, lock is held on entry and exit
+        // helpers pass no state and borrow one for the row, so it is given back
+        // while the caller still waits on the row
+        auto runOne = [&pipe, &reconstruct, &dec, &layout](unique_lock<mutex>& lock, McuState* st)
+            {
+                const auto row = pipe->ready.front();
+                pipe->ready.pop_front();
+                ++pipe->busy;
+                lock.unlock();
+                if (st)
+                    reconstruct(row, *st);
+                else
+                {
+                    ScopedMcuState own(dec, layout);
+                    reconstruct(row, *own);
+                }
+                lock.lock();
+                --pipe->busy;
+                pipe->freeSlots.push_back(row.slot);
+                pipe->cv.notify_all();
+            };
+
+        // helpers only touch the row data while the caller waits on them, so
+        // late starters see finished and leave
+        for (int h = 0; h < helpers; ++h)
+            ThreadPool::Shared().Submit([pipe, &runOne]
+                {
+                    unique_lock<mutex> lock(pipe->m);
+                    while (true)
+                    {
+                        pipe->cv.wait(lock, [&] { return pipe->finished || !pipe->ready.empty(); });
+                        if (pipe->ready.empty())
+                            return;
+                        runOne(lock, nullptr);
+                    }
+                });
+
+        bool ok = true;
+        for (int mcuY = 0; mcuY < rows && ok; ++mcuY)
+        {
+            int slot;
+            {
+                unique_lock<mutex> lock(pipe->m);
+                while (pipe->freeSlots.empty())
+                {
+                    if (!pipe->ready.empty())
+                        runOne(lock, &state);
+                    else
+                        pipe->cv.wait(lock);
+                }
+                slot = pipe->freeSlots.back();
+                pipe->freeSlots.pop_back();
+            }
+
+            const int first = mcuY * layout.mcuMaxH;
+            int* c = coeffs.data() + static_cast<size_t>(slot) * rowCoeffs;
+            uint8_t* sh = shapes.data() + static_cast<size_t>(slot) * rowBlocks;
+            int last = first;
+            while (last < first + layout.mcuMaxH)
+            {
+                if (!DecodeMcuCoeffs(dec, log, br, layout, state, c, sh, last, rows * layout.mcuMaxH))
+                {
+                    ok = false; // keep what decoded so far, like the serial path
+                    break;
+                }
+                c += layout.blocksPerMcu * 64;
+                sh += layout.blocksPerMcu;
+                ++last;
+            }
+
+            {
+                lock_guard<mutex> lock(pipe->m);
+                pipe->ready.push_back({ slot, first, last });
+            }
+            pipe->cv.notify_one();
+        }
+
+        // finish the remaining rows here, then wait for the helpers
+        unique_lock<mutex> lock(pipe->m);
+        pipe->finished = true;
+        pipe->cv.notify_all();
+        while (!pipe->ready.empty())
+            runOne(lock, &state);
+        pipe->cv.wait(lock, [&] { return pipe->busy == 0; });
+        return ok;
+    }
+
+    // find the marker ending the scan at offset, skipping stuffed bytes and RSTn
+    // returns the data size if there is none
+    size_t FindScanEnd(span<const uint8_t> d, size_t offset)
+    {
+        const uint8_t* data = d.data();
+        const size_t size = d.size();
+        size_t pos = offset;
+        while (pos + 1 < size)
+        {
+            auto p = static_cast<const uint8_t*>(memchr(data + pos, 0xFF, size - pos - 1));
+            if (p == nullptr)
+                break;
+            pos = p - data;
+            const int b = data[pos + 1];
+            if (b == 0x00 || (0xD0 <= b && b <= 0xD7))
+                pos += 2; // stuffed byte or restart marker
+            else if (b == 0xFF)
+                pos += 1; // fill byte before a marker
+            else
+                return pos;
+        }
+        return size;
+    }
+
+    // find the start of each restart interval in the scan at offset
+    // returns false if the RSTn markers are not in order or not count-1 of them
+    // end is set to the marker ending the scan
+    bool FindRestartMarkers(span<const uint8_t> d, size_t offset, int count, vector<size_t>& starts, size_t& end)
+    {
+        starts.clear();
+        starts.push_back(offset);
+        const uint8_t* data = d.data();
+        const size_t size = d.size();
+        size_t pos = offset;
+        while (pos + 1 < size)
+        {
+            auto p = static_cast<const uint8_t*>(memchr(data + pos, 0xFF, size - pos - 1));
+            if (p == nullptr)
+                break;
+            pos = p - data;
+            const int b = data[pos + 1];
+            if (b == 0x00 || b == 0xFF)
+            {
+                pos += b == 0x00 ? 2 : 1; // stuffed byte, or fill byte before a marker
+                continue;
+            }
+            if (b < 0xD0 || b > 0xD7)
+            {
+                end = pos;
+                return static_cast<int>(starts.size()) == count;
+            }
+            if (b != 0xD0 + static_cast<int>((starts.size() - 1) & 7))
+                return false;
+            pos += 2;
+            starts.push_back(pos);
+        }
+        return false; // no marker ending the scan
+    }
+
+    // MCU grid and block layout of the current scan, from the frame header
+    ScanLayout MakeScanLayout(const JpegDecoder& dec)
+    {
+        ScanLayout layout;
+
+        // max sampling factors
+        layout.channels = dec.channels;
+        int& hmax = layout.hmax;
+        int& vmax = layout.vmax;
+        int prod = 1;
+        for (int i = 0; i < dec.channels; ++i)
+        {
+            hmax = max(hmax, dec.chdefs[i].samplingH);
+            vmax = max(vmax, dec.chdefs[i].samplingV);
+            prod += dec.chdefs[i].samplingH * dec.chdefs[i].samplingV;
+        }
+        assert(prod <= 10); // Jpeg requirement
+
+        // MCU pixel width is 8 * hmax, so we want total image width X to be a multiple of this
+        // compute based on required imge, round up to multiple of 8*hmax, then scale back to pixels
+        const int X = (8 * hmax) * ((dec.frameWidth + 8 * hmax - 1) / (8 * hmax));
+        // similarly...
+        const int Y = (8 * vmax) * ((dec.frameHeight + 8 * vmax - 1) / (8 * vmax));
+
+        for (int i = 0; i < dec.channels; ++i)
+        {
+            layout.hi[i] = dec.chdefs[i].samplingH;
+            layout.vi[i] = dec.chdefs[i].samplingV;
+            layout.dcTbl[i] = layout.acTbl[i] = i == 0 ? 0 : 1; // usual, for components the scan does not name
+        }
+        for (int i = 0; i < dec.scan.count; ++i)
+        {
+            const int c = dec.scan.comp[i];
+            if (c < dec.channels)
+            {
+                layout.dcTbl[c] = dec.scan.dcTbl[i];
+                layout.acTbl[c] = dec.scan.acTbl[i];
+            }
+        }
+
+        layout.mcuMaxH = (X / 8) / hmax;
+        layout.mcuMaxV = (Y / 8) / vmax;
+        layout.mcuCount = layout.mcuMaxH * layout.mcuMaxV;
+        for (int i = 0; i < dec.channels; ++i)
+            layout.blocksPerMcu += layout.hi[i] * layout.vi[i];
+        layout.blockSize = 8 / dec.scale;
+        layout.reference = dec.idctMode == IdctMode::Reference && dec.scale == 1;
+        layout.region = dec.region;
+
+        // gray, 4:4:4, 4:2:2, 4:2:0 and 4:4:0 have writers without divides
+        // luma must have the largest factors and both chroma the same
+        layout.writeMcu = WriteMcu<0, 0>;
+        const int* hi = layout.hi;
+        const int* vi = layout.vi;
+        if (layout.channels == 1)
+            layout.writeMcu = WriteMcu<1, 1>;
+        else if (layout.channels == 3 && hi[0] == hmax && vi[0] == vmax && hi[1] == hi[2] && vi[1] == vi[2])
+        {
+            const int sx = hmax % hi[1] == 0 ? hmax / hi[1] : 0;
+            const int sy = vmax % vi[1] == 0 ? vmax / vi[1] : 0;
+            if (sx == 1 && sy == 1)
+                layout.writeMcu = WriteMcu<1, 1>;
+            else if (sx == 2 && sy == 1)
+                layout.writeMcu = WriteMcu<2, 1>;
+            else if (sx == 2 && sy == 2)
+                layout.writeMcu = WriteMcu<2, 2>;
+            else if (sx == 1 && sy == 2)
+                layout.writeMcu = WriteMcu<1, 2>;
+        }
+        return layout;
+    }
+
+    // record where each restart interval of the scan at dec.offset starts
+    bool IndexRestarts(JpegDecoder& dec, RestartIndex& index)
+    {
+        const auto layout = MakeScanLayout(dec);
+        const int intervals = (layout.mcuCount + dec.decodeInterval - 1) / dec.decodeInterval;
+        vector<size_t> starts;
+        size_t end = 0;
+        if (!FindRestartMarkers(dec.d, dec.offset, intervals, starts, end))
+        {
+            dec.logw("Restart markers missing or out of order, scan not indexed\n");
+            return false;
+        }
+        index.fileSize = dec.d.size();
+        index.frameWidth = dec.frameWidth;
+        index.frameHeight = dec.frameHeight;
+        index.interval = dec.decodeInterval;
+        index.mcuCount = layout.mcuCount;
+        index.scanEnd = end;
+        index.starts.assign(starts.begin(), starts.end());
+        dec.logi("Indexed {} restart intervals\n", intervals);
+        return true;
+    }
+
+    // natural order index of the kth zigzag coefficient
+    constexpr int ZigzagIndex(int k)
+    {
+        return (zigzagOrder[k] >> 4) * 8 + (zigzagOrder[k] & 0xF);
+    }
+
+    // progressive block decoders, jpeg spec G.1.2
+    // each returns false on an invalid code or a run past the band
+
+    // first DC scan, the DC difference scaled up by al
+    bool DecodeDcFirst(BitReader& br, const HuffTable& table, int16_t* block, int& lastDC, int al)
+    {
+        const auto len = DecodeHuffman(br, table);
+        if (len < 0)
+            return false;
+        lastDC += br.read1(len & 0x0F);
+        block[0] = static_cast<int16_t>(lastDC * (1 << al));
+        return true;
+    }
+
+    // DC refinement, one more bit
+    bool DecodeDcRefine(BitReader& br, int16_t* block, int al)
+    {
+        if (br.getBits(1))
+            block[0] |= static_cast<int16_t>(1 << al);
+        return true;
+    }
+
+    // first AC scan of band ss-se, eobrun counts following blocks that are all zero
+    bool DecodeAcFirst(BitReader& br, const HuffTable& table, int16_t* block, const ScanHeader& scan, int& eobrun)
+    {
+        if (eobrun > 0)
+        {
+            --eobrun;
+            return true;
+        }
+        for (int k = scan.ss; k <= scan.se; ++k)
+        {
+            const auto rs = DecodeHuffman(br, table);
+            if (rs < 0)
+                return false;
+            const int r = rs >> 4, s = rs & 15;
+            if (s == 0)
+            {
+                if (r < 15)
+                { // end of band run, this block and eobrun more
+                    eobrun = (1 << r) - 1;
+                    if (r > 0)
+                        eobrun += br.getBits(r);
+                    break;
+                }
+                k += 15; // 16 zeros
+                continue;
+            }
+            k += r;
+            if (k > scan.se)
+                return false;
+            block[ZigzagIndex(k)] = static_cast<int16_t>(br.read1(s) * (1 << scan.al));
+        }
+        return true;
+    }
+
+    // AC refinement, a correction bit for each nonzero coefficient in the band,
+    // new coefficients are +-1 at bit al, runs count only zero coefficients
+    bool DecodeAcRefine(BitReader& br, const HuffTable& table, int16_t* block, const ScanHeader& scan, int& eobrun)
+    {
+        const int p1 = 1 << scan.al, m1 = -p1;
+
+        auto refine = [&](int16_t& coeff)
+            {
+                if (br.getBits(1) && (coeff & p1) == 0)
+                    coeff = static_cast<int16_t>(coeff + (coeff >= 0 ? p1 : m1));
+            };
+
+        int k = scan.ss;
+        if (eobrun == 0)
+        {
+            for (; k <= scan.se; ++k)
+            {
+                const auto rs = DecodeHuffman(br, table);
+                if (rs < 0)
+                    return false;
+                int r = rs >> 4;
+                int value = 0;
+                if ((rs & 15) != 0)
+                    value = br.getBits(1) ? p1 : m1; // size is always 1
+                else if (r != 15)
+                { // end of band run, the rest of this block is refined below
+                    eobrun = 1 << r;
+                    if (r > 0)
+                        eobrun += br.getBits(r);
+                    break;
+                }
+
+                // skip r zero coefficients, refining nonzero ones on the way
+                for (; k <= scan.se; ++k)
+                {
+                    auto& coeff = block[ZigzagIndex(k)];
+                    if (coeff != 0)
+                        refine(coeff);
+                    else if (--r < 0)
+                        break;
+                }
+                if (value != 0)
+                {
+                    if (k > scan.se)
+                        return false;
+                    block[ZigzagIndex(k)] = static_cast<int16_t>(value);
+                }
+            }
+        }
+        if (eobrun > 0)
+        { // in an end of band run, only refine
+            for (; k <= scan.se; ++k)
+            {
+                auto& coeff = block[ZigzagIndex(k)];
+                if (coeff != 0)
+                    refine(coeff);
+            }
+            --eobrun;
+        }
+        return true;
+    }
+
+    // make the image from the coefficients of a progressive frame so far
+    // streams rows when dec.onScanlines is set, else fills the image
+    void RenderProgressive(JpegDecoder& dec)
+    {
+        const auto layout = MakeScanLayout(dec);
+        dec.frame.rendered = dec.frame.scans;
+        const auto& frame = dec.frame;
+        const auto kernels = GetKernels(dec.simdLevel, dec.scale);
+        auto& img = *dec.GetImage();
+        const int mcuH = layout.vmax * layout.blockSize;
+        const int first = dec.region.y / mcuH;
+        const int rows = min(layout.mcuMaxV, (dec.region.y + dec.region.h + mcuH - 1) / mcuH);
+
+        // gather the blocks of a row of MCUs in MCU order and reconstruct them
+        auto renderRow = [&](int mcuY, McuState& state, Image& target, int top)
+            {
+                for (int mcuX = 0; mcuX < layout.mcuMaxH; ++mcuX)
+                {
+                    int* c = state.coeffs.data();
+                    uint8_t* shape = state.shapes.data();
+                    for (int comp = 0; comp < layout.channels; ++comp)
+                        for (int v = 0; v < layout.vi[comp]; ++v)
+                            for (int h = 0; h < layout.hi[comp]; ++h, c += 64, ++shape)
+                            {
+                                const int16_t* block = frame.Block(comp, mcuX * layout.hi[comp] + h, mcuY * layout.vi[comp] + v);
+                                c[0] = block[0];
+                                int s = 0;
+                                for (int k = 1; k < 64; ++k)
+                                {
+                                    c[k] = block[k];
+                                    s |= block[k] != 0 ? k : 0;
+                                }
+                                *shape = static_cast<uint8_t>(s);
+                                state.counts.zeroBlocks += s == 0;
+                            }
+                    if (state.counts.on)
+                    {
+                        ++state.counts.mcus;
+                        state.counts.blocks += layout.blocksPerMcu;
+                    }
+                    ReconstructMcu(dec, layout, state, state.coeffs.data(), state.shapes.data(), mcuY * layout.mcuMaxH + mcuX, target, kernels, top);
+                }
+            };
+
+        if (dec.onScanlines)
+        {
+            ScopedMcuState state(dec, layout);
+            Image band;
+            band.Resize(img.w, mcuH, img.channels, img.format);
+            for (int mcuY = first; mcuY < rows; ++mcuY)
+            {
+                const int top = mcuY * mcuH - layout.region.y;
+                renderRow(mcuY, *state, band, top);
+                SendScanlines(dec, img, band, top);
+            }
+        }
+        else if (dec.threads != 1)
+            ThreadPool::Shared().ParallelFor(rows - first, [&](int i)
+                {
+                    ScopedMcuState state(dec, layout);
+                    renderRow(first + i, *state, img, 0);
+                }, dec.threads > 1 ? dec.threads - 1 : 0);
+        else
+        {
+            ScopedMcuState state(dec, layout);
+            for (int mcuY = first; mcuY < rows; ++mcuY)
+                renderRow(mcuY, *state, img, 0);
+        }
+    }
+
+    // decode one scan of a progressive frame into its coefficients
+    // DC scans may interleave components, AC scans have one
+    void DecodeProgressiveScan(JpegDecoder& dec)
+    {
+        auto& frame = dec.frame;
+        const auto& scan = dec.scan;
+        const auto layout = MakeScanLayout(dec);
+        const bool dc = scan.ss == 0;
+
+        if (scan.count < 1 || scan.al > 13 || scan.se > 63 || scan.se < scan.ss ||
+            (dc && scan.se != 0) || (!dc && scan.count != 1))
+        {
+            dec.loge("Invalid progressive scan, components {} coefficients {}-{} bits {},{}\n",
+                scan.count, scan.ss, scan.se, scan.ah, scan.al);
+            return;
+        }
+        for (int i = 0; i < scan.count; ++i)
+        {
+            if (scan.comp[i] >= dec.channels)
+            {
+                dec.loge("Scan component not in frame\n");
+                return;
+            }
+            const int tbl = dc ? scan.dcTbl[i] : scan.acTbl[i];
+            if ((!dc || scan.ah == 0) && !dec.huffTables[dc ? 0 : 1][tbl].defined)
+            {
+                dec.loge("Huffman table {} not defined before scan\n", tbl);
+                return;
+            }
+        }
+
+        if (frame.coeffs[0].empty())
+        { // first scan, coefficients are kept until the image ends
+            size_t blocks = 0;
+            for (int c = 0; c < layout.channels; ++c)
+            {
+                frame.blocksW[c] = layout.mcuMaxH * layout.hi[c];
+                frame.blocksH[c] = layout.mcuMaxV * layout.vi[c];
+                const size_t n = static_cast<size_t>(frame.blocksW[c]) * frame.blocksH[c];
+                frame.coeffs[c] = dec.scratch->arena.Allocate<int16_t>(n * 64);
+                blocks += n;
+            }
+            dec.logi("Progressive frame, {} coefficient blocks\n", blocks);
+        }
+        dec.logi("Progressive scan {}: {} components, coefficients {}-{}, bits {},{}\n",
+            frame.scans + 1, scan.count, scan.ss, scan.se, scan.ah, scan.al);
+
+        // a single component scan codes its blocks in raster order, not padded to MCUs, jpeg spec A.2.2
+        int units = layout.mcuCount, unitsW = layout.mcuMaxH;
+        if (scan.count == 1)
+        {
+            const int c = scan.comp[0];
+            const int compW = (dec.frameWidth * layout.hi[c] + layout.hmax - 1) / layout.hmax;
+            const int compH = (dec.frameHeight * layout.vi[c] + layout.vmax - 1) / layout.vmax;
+            unitsW = (compW + 7) / 8;
+            units = unitsW * ((compH + 7) / 8);
+        }
+
+        const int64_t start = dec.stats ? StatClock() : 0;
+        BitReader br;
+        br.Start(dec, dec.d, dec.offset);
+        int lastDC[4]{};
+        int eobrun = 0;
+        int marker = 0;
+        bool ok = true;
+        for (int unit = 0; unit < units && ok && !br.done; ++unit)
         {
-            if (done) return 0;
-            ++k;
-            if (bitPos > 0)
+            const int ux = unit % unitsW, uy = unit / unitsW;
+            for (int i = 0; i < scan.count && ok; ++i)
             {
-                auto bit = (byte >> 7) & 1;
-                byte <<= 1;
-                bitPos--;
-                return bit;
+                const int c = scan.comp[i];
+                const int bw = scan.count == 1 ? 1 : layout.hi[c];
+                const int bh = scan.count == 1 ? 1 : layout.vi[c];
+                for (int v = 0; v < bh && ok; ++v)
+                    for (int h = 0; h < bw && ok; ++h)
+                    {
+                        int16_t* block = frame.Block(c, ux * bw + h, uy * bh + v);
+                        if (dc)
+                            ok = scan.ah == 0
+                                ? DecodeDcFirst(br, dec.huffTables[0][scan.dcTbl[i]], block, lastDC[i], scan.al)
+                                : DecodeDcRefine(br, block, scan.al);
+                        else
+                            ok = scan.ah == 0
+                                ? DecodeAcFirst(br, dec.huffTables[1][scan.acTbl[i]], block, scan, eobrun)
+                                : DecodeAcRefine(br, dec.huffTables[1][scan.acTbl[i]], block, scan, eobrun);
+                    }
             }
+            if (!ok)
+                dec.loge("Invalid Huffman code or run in MCU {}\n", unit);
 
-            // get new byte
-            int b = dec->read();
-            // byte stuffing should follow any 0xFF with 0x00, if not, we're done (and should have read the 0xFFDA end marker)
-            if (b == 0xff)
+            // restart markers reset the DC predictions and end of band runs
+            if (ok && dec.decodeInterval && (unit + 1) % dec.decodeInterval == 0 && unit + 1 < units)
             {
-                int nxt = dec->read();
-                if (nxt != 00)
+                if (!br.readMarker(marker))
                 {
-                    lastCode = 0xFF00 + nxt;
-                    dec->loge(format("0x{:04X} token in compressed decode, unsupported\n", lastCode));
-                    done = true;
-                    return 0;
+                    dec.loge("Error trying to get restart marker {} at MCU {} out of {} MCUs, step size {}\n",
+                        marker, unit, units, dec.decodeInterval);
+                    ok = false;
                 }
+                marker = (marker + 1) & 7;
+                for (auto& p : lastDC)
+                    p = 0;
+                eobrun = 0;
             }
-            byte = b;
-            bitPos = 8;
-            return readOne();
-
         }
 
+        auto bitsLeft = (br.bitCount - br.padBits) & 7;
+        dec.logv("Decode finished, {} bits left over", bitsLeft);
+        dec.offset = static_cast<int>(br.pos);
+        dec.marker = marker;
+        dec.lastCode = br.lastCode;
+        if (dec.stats)
+            dec.stats->Add(StatPhase::Entropy, StatClock() - start);
 
-        int k{ 0 };
-        string scanData;
-
-        int next1() {
-            return readOne();
-        }
-
-        int read1(int bitLen)
+        ++frame.scans;
+        if (dec.onPreview && !dec.onScanlines)
         {
-            if (bitLen == 0) return 0;
-            const auto sgn = next1();
-            auto value = 1 << (--bitLen);
-            while (bitLen-- > 0)
-            {
-                auto d = next1();
-                if (d == sgn)
-                    value += 1 << bitLen;
-            }
-            return (sgn == 0 ? -1 : 1) * value;
+            RenderProgressive(dec);
+            StatTimer timer(dec.stats.get(), StatPhase::Output);
+            dec.onPreview(*dec.GetImage(), frame.scans);
         }
-    };
+    }
 
-    // return -1 for EOB, else the value
-    int DecodeHuffman(BitReader& br, const auto& tree)
+    // set up decoding the scan at dec.offset, rows is the MCU rows needed
+    // return false if the scan cannot be decoded
+    bool BeginScan(JpegDecoder& dec, ScanLayout& layout, int& rows)
     {
+        layout = MakeScanLayout(dec);
+        if (dec.idctMode == IdctMode::Reference && dec.scale != 1)
+            dec.logw("Scaled decoding uses the integer IDCT\n");
 
-        int symLen = 0;
-        int n = ROOT; // root
-        int val = 0;
-        while (true)
-        {
-            const auto bit = br.next1();
-            symLen++;
-            val = (val << 1) + bit;
-
-            if (bit == 0)
-                n = LEFT(n);
-            else
-                n = RIGHT(n);
+        // MCU rows below the region of interest need no decoding at all
+        const int mcuH = layout.vmax * layout.blockSize;
+        rows = min(layout.mcuMaxV, (dec.region.y + dec.region.h + mcuH - 1) / mcuH);
 
-            if (n >= tree.size())
+        for (int i = 0; i < dec.channels; ++i)
+        {
+            if (!dec.huffTables[0][layout.dcTbl[i]].defined)
             {
-                cout << format("FATAL bitlen {} val {:04X}\n", symLen, val);
+                dec.loge("Huffman DC table {} not defined before scan\n", layout.dcTbl[i]);
+                return false;
             }
-            if (USED(n) && tree[n] >= 0)
+            if (!dec.huffTables[1][layout.acTbl[i]].defined)
             {
-                if (tree[n] == 0x0000)
-                    return -1;
-                return tree[n];
+                dec.loge("Huffman AC table {} not defined before scan\n", layout.acTbl[i]);
+                return false;
             }
         }
-    }
 
+        dec.marker = 0; // RSTn count from 0 in each scan
+        return true;
+    }
 
-#undef PARENT
-#undef KIDS
-#undef USED
-#undef TOUCH
-#undef RIGHT
-#undef LEFT
-
-    string DumpPrefix(JpegDecoder& dec, const vector<uint8_t>& buffer, bool logData = true)
+    // after a scan decoded by one bit reader, move dec past it
+    void EndScan(JpegDecoder& dec, const BitReader& br, const ScanLayout& layout, const McuState& state, int rows)
     {
-        int len = buffer.size();
-        if (len > 50) len = 50;
-        string prefix;
-        bool inPrefix = true;
-        string s = "Data: ";
-        for (auto i = 0; i < len; ++i)
-        {
-            char c = buffer[i];
-            if (c < 32 || 127 < c) {
-                inPrefix = false;
-                c = '.';
-            }
-            s += c;
-            if (inPrefix)
-                prefix += c;
+        // The remaining bits, if any, in the scan data are discarded as
+        // they're added byte align the scan data.
+        auto bitsLeft = (br.bitCount - br.padBits) & 7;
+        dec.logv("Decode finished, {} bits left over", bitsLeft);
+
+        dec.offset = static_cast<int>(br.pos);
+        if (rows < layout.mcuMaxV)
+        { // stopped below the region of interest, skip the rest of the scan
+            dec.offset = static_cast<int>(FindScanEnd(dec.d, br.pos));
+            dec.logi("Skipped {} MCU rows below the crop\n", layout.mcuMaxV - rows);
         }
-        s += "\n";
-        if (logData)
-			dec.logi(s);
-        return prefix;
+        dec.marker = state.marker;
+        dec.lastCode = br.lastCode;
     }
 
-
     // decode compressed data
     void DecodeImg(JpegDecoder& dec)
     {
-        BitReader br;
-
-        br.dec = &dec;
-
         // to decode the possibly different sampling rates of
         // the chroma subsampling, this section notation follows
         // the Jpeg spec, Annex A
@@ -703,188 +2340,120 @@ namespace Lomont::Jpeg
     // after all decoded, we'll convert to 8 bit RGB
 
 
-        // max sampling factors
-        int hmax = 1, vmax = 1;
-        int prod = 1;
-        for (int i = 0; i < dec.channels; ++i)
+        if (dec.progressive)
         {
-            hmax = max(hmax, dec.chdefs[i].samplingH);
-            vmax = max(vmax, dec.chdefs[i].samplingV);
-            prod += dec.chdefs[i].samplingH * dec.chdefs[i].samplingV;
+            DecodeProgressiveScan(dec);
+            return;
         }
-        assert(prod <= 10); // Jpeg requirement
-
-        // MCU pixel width is 8 * hmax, so we want total image width X to be a multiple of this
-        // compute based on required imge, round up to multiple of 8*hmax, then scale back to pixels
-        const int X = (8 * hmax) * ((dec.GetImage()->w + 8 * hmax - 1) / (8 * hmax));
-        // similarly...
-        const int Y = (8 * vmax) * ((dec.GetImage()->h + 8 * vmax - 1) / (8 * vmax));
-
-
-        int xi[4], yi[4]; // pixel size of ith component
-        int hi[4], vi[4]; // sampling sizes of ith component
-        vector<vector<double>> buffers(4); // one buffer per component, used to hold one MCU
 
-        for (int i = 0; i < dec.channels; ++i)
+        ScanLayout layout;
+        int rows = 0;
+        if (!BeginScan(dec, layout, rows))
+            return;
+        const bool cropped = dec.region.w != (dec.frameWidth + dec.scale - 1) / dec.scale ||
+            dec.region.h != (dec.frameHeight + dec.scale - 1) / dec.scale;
+
+        auto& img = *(dec.GetImage());
+
+        // restart intervals are independent, so decode them in parallel
+        // when cropping, only the intervals touching the region are decoded
+        const int intervals = dec.decodeInterval > 0 ? (layout.mcuCount + dec.decodeInterval - 1) / dec.decodeInterval : 0;
+        vector<size_t> starts;
+        size_t end = 0;
+        const auto& index = dec.restartIndex;
+        bool indexed = !dec.onScanlines && intervals > 1 && index &&
+            index->Matches(dec.d.size(), dec.frameWidth, dec.frameHeight, dec.offset, dec.decodeInterval, intervals);
+        if (indexed && !index->MarkersMatch(dec.d))
         {
-            hi[i] = dec.chdefs[i].samplingH;
-            vi[i] = dec.chdefs[i].samplingV;
-
-            xi[i] = (X * hi[i] + hmax - 1) / hmax; // rounded up pixel size
-            yi[i] = (Y * vi[i] + vmax - 1) / vmax; // 
-
-            buffers[i].resize(hi[i] * vi[i] * 64); // 8x8 per sampling block
+            dec.logw("Restart index does not match the file, finding the markers instead\n");
+            indexed = false;
         }
-
-
-
-
-        // The pixel arrays for the decoded DCT coeffs
-        int run[64];
-
-
-        // running DC offsets, used as deltas per MCU block
-        int lastDC[4] = { 0,0,0 };
-
-        const int mcuMaxH = (X / 8) / hmax, mcuMaxV = (Y / 8) / vmax;
-
-        const int mcuCount = mcuMaxH * mcuMaxV;
-
-        // component ordering in jpeg spec, A.2.3
-        // a Minimum Coded Unit is a set of 8x8 blocks that make a minimal
-        // size for the various sample sizes (helps minimize mem requirements for decoding)
-        // we are ugly here and simply decode everything into RAM, then reconstruct
-
-        // todo  clean function, make comments match code.
-
-        int restartInterval = dec.decodeInterval;
-
-        for (auto mcuY = 0; mcuY < mcuMaxV; ++mcuY)
-            for (auto mcuX = 0; mcuX < mcuMaxH; ++mcuX)
+        if (indexed)
+        {
+            starts.assign(index->starts.begin(), index->starts.end());
+            end = index->scanEnd;
+            dec.logi("Using restart index\n");
+        }
+        if (!dec.onScanlines && (dec.threads != 1 || cropped || indexed) && intervals > 1 &&
+            (indexed || FindRestartMarkers(dec.d, dec.offset, intervals, starts, end)))
+        {
+            vector<int> wanted; // intervals to decode
+            for (int i = 0; i < intervals; ++i)
             {
-                const auto mcuIndex = mcuX + mcuY * mcuMaxH;
-
-                dec.logv(format("Decoding MCU-{}/{}\n", mcuIndex + 1, mcuCount));
-                for (auto compID = 0; compID < dec.channels; ++compID)
-                {
-
-                    // MCU decode for this channel
-                    for (auto mcuY = 0; mcuY < vi[compID]; ++mcuY)
-                        for (auto mcuX = 0; mcuX < hi[compID]; ++mcuX)
-                        {
-
-                            // decode 1 DC and 63 AC coeffs
-
-                            // zero block
-                            for (int j = 0; j < 64; ++j)
-                                run[j] = 0;
-
-                            int huffTbl = compID == 0 ? 0 : 1;
-
-                            int coeffCount = 0;
-
-                            while (coeffCount < 64)
-                            {
-                                // HT or AC coeffs
-                                auto acdc = coeffCount == 0 ? 0 : 1; // 0 = DC, 1 = AC
-
-                                auto value = DecodeHuffman(br, dec.tree[acdc][huffTbl]);
-
-                                if (value != -1)
-                                {
-                                    int zeroCount = (uint8_t)(value) >> 4;
-                                    int bitLen = (uint8_t)(value) & 0x0F;
-
-                                    int coeff = br.read1(bitLen);
-
-                                    coeffCount += zeroCount; // append zeros
-
-                                    run[coeffCount] = coeff;
-                                } // else default 0
-                                else if (coeffCount != 0)
-                                {
-                                    break; // done
-                                }
-                                ++coeffCount;
-                            }
-
-
-
-                            // DC_i = DC_i-1 + DC-difference
-                            lastDC[compID] += run[0];
-                            run[0] = lastDC[compID];
-
-                            // zig-zag order (i,j) as nibbles
-                            static const int zigzagOrder[64] =
-                            {
-                                0x00, 0x01, 0x10, 0x20, 0x11, 0x02, 0x03, 0x12, 0x21, 0x30, 0x40, 0x31, 0x22, 0x13, 0x04, 0x05,
-                                0x14, 0x23, 0x32, 0x41, 0x50, 0x60, 0x51, 0x42, 0x33, 0x24, 0x15, 0x06, 0x07, 0x16, 0x25, 0x34,
-                                0x43, 0x52, 0x61, 0x70, 0x71, 0x62, 0x53, 0x44, 0x35, 0x26, 0x17, 0x27, 0x36, 0x45, 0x54, 0x63,
-                                0x72, 0x73, 0x64, 0x55, 0x46, 0x37, 0x47, 0x56, 0x65, 0x74, 0x75, 0x66, 0x57, 0x67, 0x76, 0x77
-                            };
-
-                            // apply quantize, de-zigzag
-                            int block[8][8];
-                            const auto& qTbl = dec.qtbls[dec.chdefs[compID].qTbl];
-                            //   compID == 0 ? 0 : 1];
-                            for (int k = 0; k < 64; ++k)
-                            {
-                                const auto coords = zigzagOrder[k];
-                                block[coords >> 4][coords & 0xF] = run[k] * qTbl[k];
-                            }
-
-                            // invert 8x8 DCT block into real valued MCU component buffer
-                            InvertDCT(block, buffers[compID], mcuX, mcuY, hi[compID]);
-                        } // MCU x and y units 
-
-                } // components
-
-
-                int destX = mcuX * hmax * 8, destY = mcuY * vmax * 8;
+                const int first = i * dec.decodeInterval;
+                const int last = min(layout.mcuCount, first + dec.decodeInterval);
+                bool hit = false;
+                for (int mcuIndex = first; mcuIndex < last && !hit; ++mcuIndex)
+                    hit = layout.McuRect(mcuIndex).Intersects(dec.region);
+                if (hit)
+                    wanted.push_back(i);
+            }
+            if (dec.threads != 1)
+                dec.logi("Decoding {} of {} restart intervals in parallel\n", wanted.size(), intervals);
+            else
+                dec.logi("Decoding {} of {} restart intervals\n", wanted.size(), intervals);
 
-                // decode MCU into final pixels
-                DecodeMCU(
-                    buffers,
-                    *(dec.GetImage()),
-                    destX, destY,
-                    hmax * 8, vmax * 8,
-                    hi, vi,
-                    hmax, vmax,
-                    dec.channels
-                );
+            // each interval logs locally, replayed in order afterwards
+            struct Interval
+            {
+                Logger log;
+                vector<string> messages;
+                int lastCode{ -1 };
+            };
+            vector<Interval> results(wanted.size());
 
-                // restart markers?
-                if (restartInterval && mcuIndex != mcuMaxH * mcuMaxV - 1)
+            auto decodeInterval = [&](int k)
                 {
-                    if (--restartInterval == 0)
-                    {
-                        restartInterval = dec.decodeInterval;
-
-                        auto found = br.readMarker(dec.marker);
-                        if (!found)
-                        {
-                            dec.loge(format("Error trying to get restart marker {} at MCU {} out of {} MCUs, step size {}\n",
-                                dec.marker, mcuIndex, mcuMaxH * mcuMaxV, dec.decodeInterval
-                            ));
-                            return;
-
-                        }
-                        // todo - ensure order right, correct spacing, make robust?
-                        dec.marker = (dec.marker + 1) & 7;
-                        lastDC[0] = 0;
-                        lastDC[1] = 0;
-                        lastDC[2] = 0;
-                    }
-                }
+                    const int i = wanted[k];
+                    auto& r = results[k];
+                    r.log.logLevel = dec.logLevel;
+                    if (dec.output)
+                        r.log.output = [&r](const string& msg) { r.messages.push_back(msg); };
+
+                    BitReader br;
+                    br.Start(r.log, dec.d, starts[i]);
+                    ScopedMcuState state(dec, layout);
+                    const int first = i * dec.decodeInterval;
+                    const int last = min(layout.mcuCount, first + dec.decodeInterval);
+                    DecodeMcus(dec, r.log, br, layout, *state, img, first, last);
+                    r.lastCode = br.lastCode;
+                };
+            if (dec.threads == 1)
+                for (int k = 0; k < static_cast<int>(wanted.size()); ++k)
+                    decodeInterval(k);
+            else
+                ThreadPool::Shared().ParallelFor(static_cast<int>(wanted.size()), decodeInterval, dec.threads > 1 ? dec.threads - 1 : 0);
 
-            } // end of all MCU decoded
-            // The remaining bits, if any, in the scan data are discarded as
-            // they're added byte align the scan data.
+            for (auto& r : results)
+            {
+                for (auto& m : r.messages)
+                    dec.output(m);
+                dec.verboseCount += r.log.verboseCount;
+                dec.infoCount += r.log.infoCount;
+                dec.warningCount += r.log.warningCount;
+                dec.errorCount += r.log.errorCount;
+                if (dec.lastCode == -1)
+                    dec.lastCode = r.lastCode;
+            }
+            dec.marker = (intervals - 1) & 7;
+            dec.offset = static_cast<int>(end);
+            return;
+        }
 
-        auto bitsLeft = (8 - br.bitPos) & 7;
-        dec.logv(format("Decode finished, {} bits left over", bitsLeft));
+        BitReader br;
+        br.Start(dec, dec.d, dec.offset);
+        ScopedMcuState state(dec, layout);
+
+        // otherwise overlap entropy decoding with reconstruction
+        const int helpers = min(ThreadPool::Shared().Size(), dec.threads > 1 ? dec.threads - 1 : PipelineHelpers);
+        if (dec.onScanlines)
+            DecodeMcusStreaming(dec, dec, br, layout, *state, img, rows);
+        else if (dec.threads != 1 && rows > 1 && helpers > 0)
+            DecodeMcusPipelined(dec, dec, br, layout, *state, img, rows, helpers);
+        else
+            DecodeMcus(dec, dec, br, layout, *state, img, 0, rows * layout.mcuMaxH);
 
-        dec.lastCode = br.lastCode;
+        EndScan(dec, br, layout, *state, rows);
     }
 
     bool DecodeSOS(JpegDecoder& dec)
@@ -900,75 +2469,94 @@ namespace Lomont::Jpeg
             int comInfo = read2(dec); // component id and huffman tbl used
             uint8_t cID = comInfo >> 8; // 1st byte is component id
          //   assert(numCom == 4 || cID == i + 1);
-            if (numCom != 4 && cID != i+1)
-                dec.logw(format("Weird #components {} and cID {} entries in SOS\n",numCom,cID));
+            if (!dec.progressive && numCom != 4 && cID != i+1)
+                dec.logw("Weird #components {} and cID {} entries in SOS\n",numCom,cID);
 
 
             int dcNum = (comInfo >> 4) & 15; // should be 0-3 (is 0-1 for baseline jpeg)
             int acNum = (comInfo) & 15;    // should be 0-3 (is 0-1 for baseline jpeg)
             int acdc = i == 0 ? 0 : 1;
            // assert(numCom == 4 || (dcNum == acdc && acNum == acdc));
-            if (numCom != 4 && (dcNum != acdc || acNum != acdc))
+            if (!dec.progressive && numCom != 4 && (dcNum != acdc || acNum != acdc))
                 dec.logw("Weird ac,dc entries in SOS\n");
-            dec.logi(format("   {}: cid {} ac {} dc {}\n", i, cID, acNum, dcNum));
+            if (i < 4)
+            {
+                int k = 0; // frame component
+                while (k < dec.channels && dec.chdefs[k].ch != cID)
+                    ++k;
+                dec.scan.comp[i] = k;
+                dec.scan.dcTbl[i] = dcNum & 3;
+                dec.scan.acTbl[i] = acNum & 3;
+            }
+            dec.logi("   {}: cid {} ac {} dc {}\n", i, cID, acNum, dcNum);
         }
         // skip 3
         auto ss = dec.read(); // Ss - where to put first DC coeff, should be 0 in baseline
         auto se = dec.read(); // Se - last DC coeff in block, should be 63 in baseline
         auto bp = dec.read(); // Ah,Al - bit approximation stuff, should be 0,0 in baseline
-        if (ss != 0 || se != 63 || bp != 0)
-            dec.logw(format("Weird skip entries in SOS: ss {} != 0 OR se {} != 63 OR bp {} != 0\n",ss,se,bp));
-
-        DecodeImg(dec);
+        dec.scan.count = min(numCom, 4);
+        dec.scan.ss = ss;
+        dec.scan.se = se;
+        dec.scan.ah = bp >> 4;
+        dec.scan.al = bp & 15;
+        if (!dec.progressive && (ss != 0 || se != 63 || bp != 0))
+            dec.logw("Weird skip entries in SOS: ss {} != 0 OR se {} != 63 OR bp {} != 0\n",ss,se,bp);
+
+        dec.scanOffsets.push_back(dec.offset);
+        if (dec.stats)
+            ++dec.stats->scans;
+        if (dec.incremental)
+            return true; // the scan bytes may not be here yet
+        if (dec.indexOut != nullptr && dec.indexOut->starts.empty() && dec.decodeInterval > 0 && !dec.progressive)
+            IndexRestarts(dec, *dec.indexOut);
+        if (dec.probeOnly)
+        {
+            dec.offset = static_cast<int>(FindScanEnd(dec.d, dec.offset));
+            dec.logi("Probe: skipped {} bytes of scan data\n", dec.offset - dec.scanOffsets.back());
+        }
+        else
+            DecodeImg(dec);
 
         return true;
     }
 
     // try to detect a specific Application extension
     // look for bytes in header, if matches, rest copied into data
-    bool DecodeApp(JpegDecoder& dec, const string& header, const vector<uint8_t>& input, vector<uint8_t>& data)
+    // if input starts with header, data is set to the rest of it
+    bool DecodeApp(JpegDecoder& dec, const string& header, span<const uint8_t> input, span<const uint8_t>& data)
     {
-        int i = 0; // look over profile
-        bool hasPrefix = true;
-        int hlen = header.size();
-        for (auto c : input)
-        {
-            if (i < hlen)
-                hasPrefix &= header[i] == c;
-            else if (hasPrefix)
-                data.push_back(c);
-            ++i;
-        }
-        return hasPrefix;
+        const size_t hlen = min(header.size(), input.size()); // look over profile
+        if (!equal(input.begin(), input.begin() + hlen, header.begin()))
+            return false;
+        data = input.subspan(hlen);
+        return true;
     }
-    //read segment into buffer (not including length)
-    bool ReadSegment(JpegDecoder& dec, vector<uint8_t>& data)
+    // view of the segment in the input (not including length), truncated at end of data
+    span<const uint8_t> ReadSegment(JpegDecoder& dec)
     {
         uint16_t len = read2(dec);
         if (len >= 2) len -= 2;
 
-        while (len-- > 0)
-        {
-            data.push_back(dec.read());
-        }
-        return true;
-
+        const size_t start = min(static_cast<size_t>(dec.offset), dec.d.size());
+        const size_t size = min(static_cast<size_t>(len), dec.d.size() - start);
+        dec.offset = static_cast<int>(start + size);
+        return dec.d.subspan(start, size);
     }
 
-    void LogUnsupportedAppMarker(JpegDecoder & dec, const vector<uint8_t> & input, bool logData = false)
+    void LogUnsupportedAppMarker(JpegDecoder & dec, span<const uint8_t> input, bool logData = false)
     {
         auto prefix = DumpPrefix(dec, input, logData);
 
-        dec.loge(format("Unsupported marker {} {:04X} {}\n",
+        dec.loge("Unsupported marker {} {:04X} {}\n",
             dec.currentMarkerText, dec.currentMarkerCode,
             prefix
-            ));
+            );
     }
 
     bool DecodeApp0(JpegDecoder& dec)
     {
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
         auto hasJFIF = DecodeApp(dec, "JFIF\0"s, input, data);
 
         if (hasJFIF)
@@ -984,8 +2572,8 @@ namespace Lomont::Jpeg
     bool DecodeApp1(JpegDecoder& dec)
     {
         // exif https://www.kodak.com/global/plugins/acrobat/en/service/digCam/exifStandard2.pdf
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
 
         bool hasAd = false;
 
@@ -998,17 +2586,21 @@ namespace Lomont::Jpeg
         bool success = true;
         if (DecodeApp(dec, exifHeader, input, data))
         {
-            dec.logi(format("APP-1: Has EXIF info of length {}\n", data.size()));
+            dec.hasExif = true;
+            dec.logi("APP-1: Has EXIF info of length {}\n", data.size());
             if (dec.exifDecoder)
             {
+                StatTimer timer(dec.stats.get(), StatPhase::Metadata);
                 success = dec.exifDecoder(dec, data);
             }
         }
         else if (DecodeApp(dec, "http://ns.adobe.com/xap/1.0/", input, data))
         {
-            dec.logi(format("APP-1: Has XMP info of length {}\n", data.size()));
+            dec.hasXmp = true;
+            dec.logi("APP-1: Has XMP info of length {}\n", data.size());
             if (dec.xmpDecoder)
             {
+                StatTimer timer(dec.stats.get(), StatPhase::Metadata);
                 success = dec.xmpDecoder(dec, data);
                 if (success)
                 { // try hdr, only one time
@@ -1021,7 +2613,7 @@ namespace Lomont::Jpeg
         }
         else if (DecodeApp(dec, ans, input, data))
         {
-            dec.logi(format("APP-1: Has Adobe info of length {}\n", data.size()));
+            dec.logi("APP-1: Has Adobe info of length {}\n", data.size());
             dec.logw("  - Adobe format not supported\n");
         }
         else {
@@ -1041,8 +2633,8 @@ namespace Lomont::Jpeg
         // all chunks same length
         //
 
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
         string iccHeader = "ICC_PROFILE\0"s; // use C++ string literal with embedded nulls
 
         // MultiPicture format?
@@ -1056,26 +2648,27 @@ namespace Lomont::Jpeg
         {
             // read 2 bytes: 1st is 1 indexed chunk #, 2nd is # of chunks, we support both being 1
             int chunk = data[0], count = data[1];
-            dec.logi(format("APP-2: Has ICC profile of length {}, chunk {}/{}\n", data.size(), chunk, count));
+            dec.hasIcc = true;
+            dec.logi("APP-2: Has ICC profile of length {}, chunk {}/{}\n", data.size(), chunk, count);
             if (dec.iccDecoder)
             {
-                // resize data - todo - make quicker
-                data.erase(data.begin());
-                data.erase(data.begin());
-                dec.iccDecoder(dec, data);
+                StatTimer timer(dec.stats.get(), StatPhase::Metadata);
+                dec.iccDecoder(dec, data.subspan(2)); // skip chunk numbers
             }
         }
         else if (DecodeApp(dec, mpHeader, input, data))
         {
-            dec.logi(format("APP-2: Has Multi-Picture profile of length {}\n", data.size()));
+            dec.hasMpf = true;
+            dec.logi("APP-2: Has Multi-Picture profile of length {}\n", data.size());
             if (dec.mpfDecoder)
             {
+                StatTimer timer(dec.stats.get(), StatPhase::Metadata);
                 dec.mpfDecoder(dec, data);
             }
         }
         else if (DecodeApp(dec, fpxrHeader, input, data))
         {
-            dec.logi(format("APP-2: Has FlashPix profile of length {}\n", data.size()));
+            dec.logi("APP-2: Has FlashPix profile of length {}\n", data.size());
             dec.logw("   - FlashPIX not supported\n");
         }
         else {
@@ -1086,12 +2679,12 @@ namespace Lomont::Jpeg
 
     bool DecodeApp12(JpegDecoder& dec)
     { // https://exiftool.org/TagNames/APP12.html#PictureInfo
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
 
         if (DecodeApp(dec, "Ducky", input, data))
         {
-            dec.logi(format("APP-12: Has Ducky profile of length {}\n", data.size()));
+            dec.logi("APP-12: Has Ducky profile of length {}\n", data.size());
             dec.logw(" -- Ducky decode not supported\n");
         }
         else
@@ -1103,11 +2696,11 @@ namespace Lomont::Jpeg
 
     bool DecodeApp13(JpegDecoder& dec)
     {
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
 
         if (DecodeApp(dec, "Photoshop 3.0", input, data)) {
-            dec.logi(format("APP-13: Has Photoshop 3.0 profile of length {}\n", data.size()));
+            dec.logi("APP-13: Has Photoshop 3.0 profile of length {}\n", data.size());
             dec.logw("  - format parse not implemented\n");
         }
         else
@@ -1121,14 +2714,14 @@ namespace Lomont::Jpeg
     {
         // CMYK T-REC-T.872-201206, https://afpcinc.org/wp-content/uploads/2016/08/Presentation-Object-Subsets-for-AFP-03.pdf
 
-        vector<uint8_t> data, input;
-        ReadSegment(dec, input);
+        span<const uint8_t> data;
+        const auto input = ReadSegment(dec);
 
         string adobeHeader = "Adobe"s; // use C++ string literal with 2 embedded nulls
 
         if (DecodeApp(dec, adobeHeader, input, data))
         {
-            dec.logi(format("APP-14: Has Adobe info of length {}\n", data.size()));
+            dec.logi("APP-14: Has Adobe info of length {}\n", data.size());
             dec.logw("   - Adobe APP-14 not supported\n");
         }
         else
@@ -1149,7 +2742,7 @@ namespace Lomont::Jpeg
             char c = dec.read(); // NOTE: COM string may or may not have 0 terminator
             s += c;
         }
-        dec.logi(format("  <{}>\n", s));
+        dec.logi("  <{}>\n", s);
         return true;
     }
 
@@ -1159,7 +2752,7 @@ namespace Lomont::Jpeg
         if (len >= 2) len -= 2;
         dec.decodeInterval = read2(dec);
 
-        dec.logi(format("DRI: {}\n", dec.decodeInterval));
+        dec.logi("DRI: {}\n", dec.decodeInterval);
         return true;
     }
 
@@ -1174,8 +2767,7 @@ namespace Lomont::Jpeg
 
     bool Unsupported(JpegDecoder& dec)
     {
-        vector<uint8_t> input;
-        ReadSegment(dec, input);
+        const auto input = ReadSegment(dec);
 
         LogUnsupportedAppMarker(dec, input, true);
 
@@ -1200,7 +2792,7 @@ namespace Lomont::Jpeg
     {
         {0xFFC0,"SOF0",DecodeSOF},   // start of frame, baseline DCT
         {0xFFC1,"SOF1",Unsupported}, // start of frame 1, Extended sequential DCT
-        {0xFFC2,"SOF2",Fail}, // start of frame 2, Progressive DCT
+        {0xFFC2,"SOF2",DecodeSOF}, // start of frame 2, Progressive DCT
         {0xFFC3,"SOF3",Unsupported}, // start of frame 3, Lossless (Sequential)
         {0xFFC4,"DHT",DecodeDHT}, // Huffman tables, 4 for color, 2 for gray
         {0xFFC5,"SOF5",Unsupported}, // start of frame 5, Differential Sequential DCT
@@ -1271,82 +2863,129 @@ namespace Lomont::Jpeg
     };
 
 
+    // start the next image, multi picture files have several
+    void BeginImage(JpegDecoder& dec)
+    {
+        dec.logi("\n\n"); // space before next file
+        if (dec.spareImages.empty())
+            dec.images.emplace_back(make_shared<Image>()); // possibly new image
+        else
+        { // storage from before Reset
+            dec.images.emplace_back(move(dec.spareImages.back()));
+            dec.spareImages.pop_back();
+            dec.images.back()->Clear();
+        }
+    }
+
+    // decode the marker segment at dec.offset
+    // return false when the image should stop parsing
+    bool DecodeSegment(JpegDecoder& dec, bool& sawEOI)
+    {
+        int offset = dec.offset;
+        const uint16_t seg = read2(dec);
+        bool more = true;
+        string txt = "???";
+        int length = 0; // default
+        if (0xFFC0 <= seg)
+        {
+            dec.seg = seg;
+            const auto& j = jumps[seg - 0xFFC0];
+            if (j.txt != "SOI" && j.txt != "EOI")
+            {
+                const int off1 = dec.offset;
+                length = read2(dec);
+                dec.offset = off1;
+            }
+            dec.currentMarkerCode = j.code;
+            dec.currentMarkerText = j.txt;
+            dec.logi("Marker: {} ({:02X}) offset {:08X} length {}\n", j.txt, j.code, offset, length);
+            // scans are timed as they decode, metadata by its decoders
+            const int64_t start = dec.stats && seg != 0xFFDA ? StatClock() : 0;
+            const int64_t metadata = dec.stats ? dec.stats->Ns(StatPhase::Metadata) : 0;
+            more = j.func(dec);
+            if (dec.stats && seg != 0xFFDA)
+                dec.stats->Add(StatPhase::Markers, StatClock() - start - (dec.stats->Ns(StatPhase::Metadata) - metadata));
+            txt = j.txt;
+            if (j.txt == "EOI")
+                sawEOI = true;
+        }
+        else
+        {
+            dec.loge("Unknown marker {:02X}, offset {:08X} exiting.\n", seg, offset);
+            skipNext(dec);
+            more = false;
+
+        }
+        const int actualLength = dec.offset - offset - 2; // remove 2 byte marker length
+        if (length != actualLength && seg != 0xFFDA /* SOS */)
+            dec.logw("Marker predicted length {} != marker actual length {}\n", length, actualLength);
+        return more;
+    }
+
+    // after the last segment of an image, return true if more bytes follow
+    bool EndImage(JpegDecoder& dec, bool sawEOI)
+    {
+        if (dec.progressive && dec.frame.scans > dec.frame.rendered)
+        { // a preview of the last scan may have made it already
+            dec.logi("Making progressive image from {} scans\n", dec.frame.scans);
+            RenderProgressive(dec);
+        }
+        dec.progressive = false;
+        dec.frame = ProgressiveFrame(); // the coefficients stay in the arena until Reset
+
+        bool moreBytes = false; // assume no extra
+        if (static_cast<size_t>(dec.offset) < dec.d.size())
+        {
+            dec.logw("{} bytes past end of file\n", dec.d.size() - dec.offset);
+            moreBytes = true;
+        }
+        if (!sawEOI)
+            dec.logw("Did not parse EOI marker\n");
+
+        dec.splitOffsets.push_back(dec.offset);
+        return moreBytes;
+    }
+
     bool DecodeJpg(JpegDecoder& dec)
     {
         bool moreBytes = false;
         do { // loop over MultiPictureFormat when present
-            dec.logi("\n\n"); // space before next file
-
-            dec.images.emplace_back(make_shared<Image>()); // possibly new image
-            moreBytes = false; // assume no extra
+            BeginImage(dec);
             bool more = true;
             bool sawEOI = false;
             while (more && dec.lastCode == -1)
-            {
-                int offset = dec.offset;
-                const uint16_t seg = read2(dec);
-                string txt = "???";
-                int length = 0; // default
-                if (0xFFC0 <= seg)
-                {
-                    dec.seg = seg;
-                    const auto& j = jumps[seg - 0xFFC0];
-                    if (j.txt != "SOI" && j.txt != "EOI")
-                    {
-                        const int off1 = dec.offset;
-                        length = read2(dec);
-                        dec.offset = off1;
-                    }
-                    dec.currentMarkerCode = j.code;
-                    dec.currentMarkerText = j.txt;
-                    dec.logi(format("Marker: {} ({:02X}) offset {:08X} length {}\n", j.txt, j.code, offset, length));
-                    more = j.func(dec);
-                    txt = j.txt;
-                    if (j.txt == "EOI")
-                        sawEOI = true;
-                }
-                else
-                {
-                    dec.loge(format("Unknown marker {:02X}, offset {:08X} exiting.\n", seg, offset));
-                    skipNext(dec);
-                    more = false;
-
-                }
-                const int actualLength = dec.offset - offset - 2; // remove 2 byte marker length
-                if (length != actualLength && seg != 0xFFDA /* SOS */)
-                    dec.logw(format("Marker predicted length {} != marker actual length {}\n", length, actualLength));
-            }
-            if (dec.offset < dec.d.size())
-            {
-                dec.logw(format("{} bytes past end of file\n", dec.d.size() - dec.offset));
-                moreBytes = true;
-            }
-            if (!sawEOI)
-                dec.logw("Did not parse EOI marker\n");
-
-        	dec.splitOffsets.push_back(dec.offset);
+                more = DecodeSegment(dec, sawEOI);
+            moreBytes = EndImage(dec, sawEOI);
         } while (moreBytes);
         return true;
     }
 
     void WritePPM(const std::string& filename, const shared_ptr<Image> & img)
     { // https://netpbm.sourceforge.net/doc/ppm.html
+        const int bpp = img->PixelSize();
+        if (bpp == 0)
+            return; // planar images have no RGB pixels
+        const bool bgr = img->format == PixelFormat::BGR || img->format == PixelFormat::BGRA;
         ofstream file(filename);
         file << "P3\n"; // color 24 bit, ASCII
         file << "# Chris Lomont jpeg decoder output\n";
         file << img->w << " " << img->h << "\n"; // width height
         file << 255 << endl; // max value
-        auto p = img->data.data();
-        auto rowsize = img->w * img->channels;
-        for (int index = 0; index < rowsize * img->h; index += img->channels)
-        {
-            file << format("{} {} {} ",
-                p[index],
-                p[index + 1],
-                p[index + 2]
-            );
-            if ((index % rowsize) == rowsize - img->channels)
-                file << "\n";
+        for (int j = 0; j < img->h; ++j)
+        {
+            auto p = img->Row(j);
+            for (int i = 0; i < img->w; ++i, p += bpp)
+            {
+                if (bpp == 1)
+                    file << format("{} {} {} ", p[0], p[0], p[0]);
+                else
+                    file << format("{} {} {} ",
+                        p[bgr ? 2 : 0],
+                        p[1],
+                        p[bgr ? 0 : 2]
+                    );
+            }
+            file << "\n";
         }
         file.close();
     }
@@ -1371,18 +3010,13 @@ namespace Lomont::Jpeg
         }
     }
 
-    void Decode(string filename, JpegDecoder& dec)
+    // decode bytes in memory, they must outlive any use of dec.d
+    // name is only used for logging
+    // attach the metadata decoders and default output
+    void SetupDecoder(JpegDecoder& dec)
     {
-
-        ifstream instream(filename, ios::in | ios::binary);
-
-        vector<uint8_t> d((istreambuf_iterator<char>(instream)), istreambuf_iterator<char>());
-
-        dec.d = d;
-        dec.offset = 0;
-
         // attach some decoders
-#define AddDecoder(dest,type) dec.dest = [](Logger& logger, const vector<uint8_t>& data){ type e; return e.Decode(logger,data);}
+#define AddDecoder(dest,type) dec.dest = [](Logger& logger, span<const uint8_t> data){ type e; return e.Decode(logger,data);}
 
         AddDecoder(exifDecoder, ExifDecoder);
         AddDecoder(iccDecoder, IccDecoder);
@@ -1394,10 +3028,178 @@ namespace Lomont::Jpeg
         // set output
         if (!dec.output)
             dec.output = [](const string& msg) {cout << msg; };
+    }
+
+    // start the stats of a decode, if any
+    void BeginStats(JpegDecoder& dec, const string& name)
+    {
+        if (!dec.stats)
+            return;
+        dec.stats->filename = name;
+        dec.stats->startNs = StatClock();
+        dec.stats->arenaAllocations = dec.scratch->arena.Allocations();
+        dec.stats->arenaBytes = dec.scratch->arena.AllocatedBytes();
+    }
+
+    // finish the stats of a decode, if any
+    void EndStats(JpegDecoder& dec)
+    {
+        if (!dec.stats)
+            return;
+        auto& stats = *dec.stats;
+        stats.totalNs += StatClock() - stats.startNs;
+        stats.bytes = dec.offset;
+        stats.images = dec.images.size();
+        stats.allocations += dec.scratch->arena.Allocations() - stats.arenaAllocations;
+        stats.allocatedBytes += dec.scratch->arena.AllocatedBytes() - stats.arenaBytes;
+    }
+
+    void Decode(span<const uint8_t> bytes, JpegDecoder& dec, const string& name = "<memory>")
+    {
+        BeginStats(dec, name);
+        dec.d = bytes;
+        dec.offset = 0;
+        SetupDecoder(dec);
 
-        dec.logi(format("Filename: {}\nFilesize: {}\n", filename, d.size()));
+        dec.logi("Filename: {}\nFilesize: {}\n", name, bytes.size());
 
         DecodeJpg(dec);
+        EndStats(dec);
+    }
+
+    // decode a file, memory mapped when possible, no copies are made
+    void Decode(string filename, JpegDecoder& dec)
+    {
+        auto file = make_shared<MappedFile>(filename);
+        dec.input = file;
+        Decode(file->Bytes(), dec, filename);
+    }
+
+    // parse headers and metadata only, for triage before a full decode
+    // fills dec.images sizes and sampling (no pixels), dec.scanOffsets, dec.hasExif etc., dec.hdr
+    void Probe(span<const uint8_t> bytes, JpegDecoder& dec, const string& name = "<memory>")
+    {
+        dec.probeOnly = true;
+        Decode(bytes, dec, name);
+    }
+
+    void Probe(string filename, JpegDecoder& dec)
+    {
+        dec.probeOnly = true;
+        Decode(filename, dec);
+    }
+
+    // index the restart intervals of a file's first scan that has them
+    // returns false if the file has no usable restart markers
+    bool BuildRestartIndex(const string& filename, RestartIndex& index)
+    {
+        index = RestartIndex();
+        JpegDecoder dec;
+        dec.output = [](const string&) {}; // quiet
+        dec.indexOut = &index;
+        Probe(filename, dec);
+        return index.Valid();
+    }
+
+    // load the sidecar index of a file, else build it and save the sidecar
+    // a tile server sets dec.restartIndex to this and decodes crops
+    bool LoadRestartIndex(const string& filename, RestartIndex& index, bool saveSidecar = true)
+    {
+        const auto sidecar = RestartIndex::SidecarName(filename);
+        if (index.Load(sidecar) && index.MarkersMatch(MappedFile(filename).Bytes()))
+            return true; // a stale sidecar is rebuilt
+        if (!BuildRestartIndex(filename, index))
+            return false;
+        if (saveSidecar)
+            index.Save(sidecar);
+        return true;
+    }
+
+    // result of one file in a batch
+    struct BatchResult
+    {
+        string filename;
+        string log; // everything the decoder output at its log level
+        int errorCount{ 0 }, warningCount{ 0 };
+        bool exception{ false }; // decode threw
+        shared_ptr<DecodeStats> stats; // when setup turned them on
+    };
+
+    struct BatchResults
+    {
+        vector<BatchResult> files; // same order as the input
+        int fileCount{ 0 }, filesWithErrors{ 0 };
+        int errorCount{ 0 }, warningCount{ 0 }; // totals over all files
+    };
+
+    // decode many files concurrently on the shared pool
+    // decoders are reused, Reset between files, so their memory is too
+    // setup is called on each decoder before decoding, ex: to set the log level
+    // done is called on the worker thread after each decode with the input index,
+    // so images can be used without holding every decoder
+    // decoders default to single threaded, the files are the parallel work
+    BatchResults DecodeFiles(
+        const vector<string>& filenames,
+        const function<void(JpegDecoder& dec)>& setup = nullptr,
+        const function<void(size_t index, JpegDecoder& dec)>& done = nullptr
+    )
+    {
+        BatchResults results;
+        results.files.resize(filenames.size());
+        mutex decodersMutex;
+        vector<unique_ptr<JpegDecoder>> decoders; // idle ones
+
+        ThreadPool::Shared().ParallelFor(static_cast<int>(filenames.size()), [&](int i)
+            {
+                auto& r = results.files[i];
+                r.filename = filenames[i];
+
+                unique_ptr<JpegDecoder> decoder;
+                {
+                    lock_guard<mutex> lock(decodersMutex);
+                    if (!decoders.empty())
+                    {
+                        decoder = move(decoders.back());
+                        decoders.pop_back();
+                    }
+                }
+                if (decoder)
+                    decoder->Reset();
+                else
+                    decoder = make_unique<JpegDecoder>();
+                auto& dec = *decoder;
+                dec.threads = 1;
+                if (setup)
+                    setup(dec);
+                dec.output = [&r](const string& msg) { r.log += msg; };
+                try
+                {
+                    Decode(r.filename, dec);
+                    if (done)
+                        done(i, dec);
+                }
+                catch (exception&)
+                {
+                    r.exception = true;
+                    dec.loge("Exception!\n");
+                }
+                r.errorCount = dec.errorCount;
+                r.warningCount = dec.warningCount;
+                r.stats = dec.stats;
+
+                lock_guard<mutex> lock(decodersMutex);
+                decoders.push_back(move(decoder));
+            });
+
+        for (auto& r : results.files)
+        {
+            results.fileCount++;
+            results.errorCount += r.errorCount;
+            results.warningCount += r.warningCount;
+            if (r.errorCount > 0)
+                results.filesWithErrors++;
+        }
+        return results;
     }
 
 
@@ -0,0 +1,702 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+// integer pixel kernels: inverse DCT (with dequantization) and YCbCr -> RGB
+// scalar versions are the reference, SSE4.1 and AVX2 versions give bit identical
+// results and are picked at runtime from the CPU features
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LOMONT_JPEG_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LOMONT_JPEG_TARGET(t)
+#else
+#define LOMONT_JPEG_TARGET(t) __attribute__((target(t)))
+#endif
+#endif
+
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    // IDCT fixed point, constants are round(x * 2^IdctConstBits)
+    constexpr int IdctConstBits = 13;
+    constexpr int IdctPass1Bits = 2;
+    constexpr int32_t FIX_0_298631336 = 2446;
+    constexpr int32_t FIX_0_390180644 = 3196;
+    constexpr int32_t FIX_0_541196100 = 4433;
+    constexpr int32_t FIX_0_765366865 = 6270;
+    constexpr int32_t FIX_0_899976223 = 7373;
+    constexpr int32_t FIX_1_175875602 = 9633;
+    constexpr int32_t FIX_1_501321110 = 12299;
+    constexpr int32_t FIX_1_847759065 = 15137;
+    constexpr int32_t FIX_1_961570560 = 16069;
+    constexpr int32_t FIX_2_053119869 = 16819;
+    constexpr int32_t FIX_2_562915447 = 20995;
+    constexpr int32_t FIX_3_072711026 = 25172;
+
+    // color conversion fixed point, CCIR 601, constants are round(x * 2^ColorFracBits)
+    constexpr int ColorFracBits = 16;
+    constexpr int32_t ColorCrR = 91881;  // 1.402
+    constexpr int32_t ColorCbG = -22554; // -0.344136
+    constexpr int32_t ColorCrG = -46802; // -0.714136
+    constexpr int32_t ColorCbB = 116130; // 1.772
+
+    // which coefficients of a block can be nonzero, the OR of the natural order
+    // indices of its nonzero AC coefficients, kept by the entropy decoder
+    // 0 is a DC only block, without the high bits all are in the top left 4x4
+    constexpr uint8_t BlockShapeHigh = 0x24; // row or column 4 or more
+    constexpr uint8_t BlockShapeFull = 0x3F; // anything
+
+    // 1-D IDCT of 8 values, descaled by shift into o[0], o[step], ...
+    inline void InvertDCTInt1D(int32_t i0, int32_t i1, int32_t i2, int32_t i3, int32_t i4, int32_t i5, int32_t i6, int32_t i7,
+                               int32_t* o, int step, int shift)
+    {
+        const int32_t round = 1 << (shift - 1);
+
+        // even part
+        int32_t z1 = (i2 + i6) * FIX_0_541196100;
+        const int32_t tmp2 = z1 - i6 * FIX_1_847759065;
+        const int32_t tmp3 = z1 + i2 * FIX_0_765366865;
+        const int32_t tmp0 = (i0 + i4) * (1 << IdctConstBits);
+        const int32_t tmp1 = (i0 - i4) * (1 << IdctConstBits);
+        const int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+        const int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+        // odd part
+        z1 = i7 + i1;
+        int32_t z2 = i5 + i3, z3 = i7 + i3, z4 = i5 + i1;
+        const int32_t z5 = (z3 + z4) * FIX_1_175875602;
+        int32_t t0 = i7 * FIX_0_298631336, t1 = i5 * FIX_2_053119869;
+        int32_t t2 = i3 * FIX_3_072711026, t3 = i1 * FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+        t0 += z1 + z3;
+        t1 += z2 + z4;
+        t2 += z2 + z3;
+        t3 += z1 + z4;
+
+        o[0 * step] = (tmp10 + t3 + round) >> shift;
+        o[7 * step] = (tmp10 - t3 + round) >> shift;
+        o[1 * step] = (tmp11 + t2 + round) >> shift;
+        o[6 * step] = (tmp11 - t2 + round) >> shift;
+        o[2 * step] = (tmp12 + t1 + round) >> shift;
+        o[5 * step] = (tmp12 - t1 + round) >> shift;
+        o[3 * step] = (tmp13 + t0 + round) >> shift;
+        o[4 * step] = (tmp13 - t0 + round) >> shift;
+    }
+
+    // separable integer inverse DCT, Loeffler-Ligtenberg-Moschytz style as in IJG jidctint.c
+    // coeffs are in natural order, multiplied by the quantization table in the first pass
+    // output is level shifted and clamped to 8 bit samples, stride is output row length
+    inline void InvertDCTInt(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // columns, dequantize on the way in
+        int32_t work[64];
+        for (int c = 0; c < 8; ++c)
+        {
+            auto dq = [&](int r) { return coeffs[r * 8 + c] * mul[r * 8 + c]; };
+            InvertDCTInt1D(dq(0), dq(1), dq(2), dq(3), dq(4), dq(5), dq(6), dq(7),
+                work + c, 8, IdctConstBits - IdctPass1Bits);
+        }
+
+        // rows, remove pass 1 scaling and the 8x from the 2-D transform
+        for (int r = 0; r < 8; ++r)
+        {
+            const int32_t* w = work + r * 8;
+            int32_t row[8];
+            InvertDCTInt1D(w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7],
+                row, 1, IdctConstBits + IdctPass1Bits + 3);
+            for (int c = 0; c < 8; ++c)
+                out[r * stride + c] = static_cast<uint8_t>(std::clamp(row[c] + 128, 0, 255));
+        }
+    }
+
+    // InvertDCTInt for a block with all coefficients in the top left 4x4
+    // the zero terms drop out, integer math makes it bit identical
+    inline void InvertDCTIntLow(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // columns 4-7 are zero in and out
+        int32_t work[64];
+        for (int c = 0; c < 4; ++c)
+        {
+            auto dq = [&](int r) { return coeffs[r * 8 + c] * mul[r * 8 + c]; };
+            InvertDCTInt1D(dq(0), dq(1), dq(2), dq(3), 0, 0, 0, 0,
+                work + c, 8, IdctConstBits - IdctPass1Bits);
+        }
+
+        for (int r = 0; r < 8; ++r)
+        {
+            const int32_t* w = work + r * 8;
+            int32_t row[8];
+            InvertDCTInt1D(w[0], w[1], w[2], w[3], 0, 0, 0, 0,
+                row, 1, IdctConstBits + IdctPass1Bits + 3);
+            for (int c = 0; c < 8; ++c)
+                out[r * stride + c] = static_cast<uint8_t>(std::clamp(row[c] + 128, 0, 255));
+        }
+    }
+
+    // InvertDCTInt for a DC only block, every sample is the same
+    inline void InvertDCTIntDc(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        constexpr int shift1 = IdctConstBits - IdctPass1Bits, shift2 = IdctConstBits + IdctPass1Bits + 3;
+        const int32_t col = (coeffs[0] * mul[0] * (1 << IdctConstBits) + (1 << (shift1 - 1))) >> shift1;
+        const int32_t v = (col * (1 << IdctConstBits) + (1 << (shift2 - 1))) >> shift2;
+        const auto sample = static_cast<uint8_t>(std::clamp(v + 128, 0, 255));
+        for (int r = 0; r < 8; ++r)
+            memset(out + r * stride, sample, 8);
+    }
+
+    // reduced size inverse DCTs for scaled decoding, as in IJG jidctred.c
+    // each uses the low frequency coefficients of an 8x8 block to make a
+    // 4x4, 2x2 or 1x1 block, same inputs and output format as InvertDCTInt
+    constexpr int32_t FIX_0_211164243 = 1730;
+    constexpr int32_t FIX_0_509795579 = 4176;
+    constexpr int32_t FIX_0_601344887 = 4926;
+    constexpr int32_t FIX_0_720959822 = 5906;
+    constexpr int32_t FIX_0_850430095 = 6967;
+    constexpr int32_t FIX_1_061594337 = 8697;
+    constexpr int32_t FIX_1_272758580 = 10426;
+    constexpr int32_t FIX_1_451774981 = 11893;
+    constexpr int32_t FIX_2_172734803 = 17799;
+    constexpr int32_t FIX_3_624509785 = 29692;
+
+    inline void InvertDCTInt4(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // 1-D 4 point output from inputs 0,1,2,3,5,6,7 (4 does not contribute)
+        auto idct1 = [](int32_t i0, int32_t i1, int32_t i2, int32_t i3, int32_t i5, int32_t i6, int32_t i7,
+                        int32_t* o, int step, int shift)
+            {
+                const int32_t round = 1 << (shift - 1);
+
+                // even part
+                const int32_t tmp0 = i0 * (1 << (IdctConstBits + 1));
+                const int32_t tmp2 = i2 * FIX_1_847759065 - i6 * FIX_0_765366865;
+                const int32_t tmp10 = tmp0 + tmp2, tmp12 = tmp0 - tmp2;
+
+                // odd part
+                const int32_t t0 = -i7 * FIX_0_211164243 + i5 * FIX_1_451774981 - i3 * FIX_2_172734803 + i1 * FIX_1_061594337;
+                const int32_t t2 = -i7 * FIX_0_509795579 - i5 * FIX_0_601344887 + i3 * FIX_0_899976223 + i1 * FIX_2_562915447;
+
+                o[0 * step] = (tmp10 + t2 + round) >> shift;
+                o[3 * step] = (tmp10 - t2 + round) >> shift;
+                o[1 * step] = (tmp12 + t0 + round) >> shift;
+                o[2 * step] = (tmp12 - t0 + round) >> shift;
+            };
+
+        // columns, dequantize on the way in, column 4 is not needed
+        int32_t work[4 * 8];
+        for (int c = 0; c < 8; ++c)
+        {
+            if (c == 4) continue;
+            auto dq = [&](int r) { return coeffs[r * 8 + c] * mul[r * 8 + c]; };
+            idct1(dq(0), dq(1), dq(2), dq(3), dq(5), dq(6), dq(7), work + c, 8, IdctConstBits - IdctPass1Bits + 1);
+        }
+
+        // rows
+        for (int r = 0; r < 4; ++r)
+        {
+            const int32_t* w = work + r * 8;
+            int32_t row[4];
+            idct1(w[0], w[1], w[2], w[3], w[5], w[6], w[7], row, 1, IdctConstBits + IdctPass1Bits + 3 + 1);
+            for (int c = 0; c < 4; ++c)
+                out[r * stride + c] = static_cast<uint8_t>(std::clamp(row[c] + 128, 0, 255));
+        }
+    }
+
+    inline void InvertDCTInt2(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // 1-D 2 point output from inputs 0,1,3,5,7 (even ones above 0 do not contribute)
+        auto idct1 = [](int32_t i0, int32_t i1, int32_t i3, int32_t i5, int32_t i7, int32_t* o, int step, int shift)
+            {
+                const int32_t round = 1 << (shift - 1);
+                const int32_t tmp10 = i0 * (1 << (IdctConstBits + 2));
+                const int32_t tmp0 = -i7 * FIX_0_720959822 + i5 * FIX_0_850430095 - i3 * FIX_1_272758580 + i1 * FIX_3_624509785;
+                o[0] = (tmp10 + tmp0 + round) >> shift;
+                o[step] = (tmp10 - tmp0 + round) >> shift;
+            };
+
+        int32_t work[2 * 8];
+        for (int c = 0; c < 8; ++c)
+        {
+            if (c == 2 || c == 4 || c == 6) continue;
+            auto dq = [&](int r) { return coeffs[r * 8 + c] * mul[r * 8 + c]; };
+            idct1(dq(0), dq(1), dq(3), dq(5), dq(7), work + c, 8, IdctConstBits - IdctPass1Bits + 2);
+        }
+
+        for (int r = 0; r < 2; ++r)
+        {
+            const int32_t* w = work + r * 8;
+            int32_t row[2];
+            idct1(w[0], w[1], w[3], w[5], w[7], row, 1, IdctConstBits + IdctPass1Bits + 3 + 2);
+            for (int c = 0; c < 2; ++c)
+                out[r * stride + c] = static_cast<uint8_t>(std::clamp(row[c] + 128, 0, 255));
+        }
+    }
+
+    // DC only, the block average
+    inline void InvertDCTInt1(const int coeffs[64], const int32_t mul[64], uint8_t* out, int)
+    {
+        out[0] = static_cast<uint8_t>(std::clamp(((coeffs[0] * mul[0] + 4) >> 3) + 128, 0, 255));
+    }
+
+    // YCbCr -> RGB, Cb and Cr are centered on 0, outputs clamped to 0-255
+    inline void YCbCrToRGB(int Y, int Cb, int Cr, int& R, int& G, int& B)
+    {
+        constexpr int half = 1 << (ColorFracBits - 1);
+        R = std::clamp(Y + ((ColorCrR * Cr + half) >> ColorFracBits), 0, 255);
+        G = std::clamp(Y + ((ColorCbG * Cb + ColorCrG * Cr + half) >> ColorFracBits), 0, 255);
+        B = std::clamp(Y + ((ColorCbB * Cb + half) >> ColorFracBits), 0, 255);
+    }
+
+    // convert a row of 8 bit Y, Cb, Cr samples to interleaved RGB
+    inline void ColorRowScalar(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            int R, G, B;
+            YCbCrToRGB(y[i], cb[i] - 128, cr[i] - 128, R, G, B);
+            rgb[3 * i + 0] = static_cast<uint8_t>(R);
+            rgb[3 * i + 1] = static_cast<uint8_t>(G);
+            rgb[3 * i + 2] = static_cast<uint8_t>(B);
+        }
+    }
+
+    enum class SimdLevel
+    {
+        Scalar,
+        Sse41,
+        Avx2
+    };
+
+#if defined(LOMONT_JPEG_X86)
+
+    // best SIMD level the CPU and OS support
+    inline SimdLevel DetectSimd()
+    {
+        static const SimdLevel level = []
+            {
+#if defined(_MSC_VER) && !defined(__clang__)
+                int info[4];
+                __cpuid(info, 0);
+                const int maxLeaf = info[0];
+                __cpuid(info, 1);
+                const bool sse41 = (info[2] & (1 << 19)) != 0;
+                const bool osxsave = (info[2] & (1 << 27)) != 0;
+                const bool avx = (info[2] & (1 << 28)) != 0;
+                bool avx2 = false;
+                if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+                {
+                    __cpuidex(info, 7, 0);
+                    avx2 = (info[1] & (1 << 5)) != 0;
+                }
+#else
+                __builtin_cpu_init();
+                const bool sse41 = __builtin_cpu_supports("sse4.1");
+                const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+                return avx2 ? SimdLevel::Avx2 : sse41 ? SimdLevel::Sse41 : SimdLevel::Scalar;
+            }();
+        return level;
+    }
+
+    // one 1-D IDCT pass over 8 vectors v[0..7], P is the intrinsic prefix (_mm_ or _mm256_)
+    // same operations in the same order as the scalar idct1, so results are identical
+#define LOMONT_JPEG_IDCT_1D(P, v, shift) \
+    { \
+        const auto rnd = P##set1_epi32(1 << ((shift) - 1)); \
+        auto z1 = P##mullo_epi32(P##add_epi32(v[2], v[6]), P##set1_epi32(FIX_0_541196100)); \
+        const auto tmp2 = P##sub_epi32(z1, P##mullo_epi32(v[6], P##set1_epi32(FIX_1_847759065))); \
+        const auto tmp3 = P##add_epi32(z1, P##mullo_epi32(v[2], P##set1_epi32(FIX_0_765366865))); \
+        const auto tmp0 = P##slli_epi32(P##add_epi32(v[0], v[4]), IdctConstBits); \
+        const auto tmp1 = P##slli_epi32(P##sub_epi32(v[0], v[4]), IdctConstBits); \
+        const auto tmp10 = P##add_epi32(tmp0, tmp3), tmp13 = P##sub_epi32(tmp0, tmp3); \
+        const auto tmp11 = P##add_epi32(tmp1, tmp2), tmp12 = P##sub_epi32(tmp1, tmp2); \
+        z1 = P##add_epi32(v[7], v[1]); \
+        auto z2 = P##add_epi32(v[5], v[3]); \
+        auto z3 = P##add_epi32(v[7], v[3]); \
+        auto z4 = P##add_epi32(v[5], v[1]); \
+        const auto z5 = P##mullo_epi32(P##add_epi32(z3, z4), P##set1_epi32(FIX_1_175875602)); \
+        auto t0 = P##mullo_epi32(v[7], P##set1_epi32(FIX_0_298631336)); \
+        auto t1 = P##mullo_epi32(v[5], P##set1_epi32(FIX_2_053119869)); \
+        auto t2 = P##mullo_epi32(v[3], P##set1_epi32(FIX_3_072711026)); \
+        auto t3 = P##mullo_epi32(v[1], P##set1_epi32(FIX_1_501321110)); \
+        z1 = P##mullo_epi32(z1, P##set1_epi32(-FIX_0_899976223)); \
+        z2 = P##mullo_epi32(z2, P##set1_epi32(-FIX_2_562915447)); \
+        z3 = P##add_epi32(P##mullo_epi32(z3, P##set1_epi32(-FIX_1_961570560)), z5); \
+        z4 = P##add_epi32(P##mullo_epi32(z4, P##set1_epi32(-FIX_0_390180644)), z5); \
+        t0 = P##add_epi32(t0, P##add_epi32(z1, z3)); \
+        t1 = P##add_epi32(t1, P##add_epi32(z2, z4)); \
+        t2 = P##add_epi32(t2, P##add_epi32(z2, z3)); \
+        t3 = P##add_epi32(t3, P##add_epi32(z1, z4)); \
+        v[0] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp10, t3), rnd), shift); \
+        v[7] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp10, t3), rnd), shift); \
+        v[1] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp11, t2), rnd), shift); \
+        v[6] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp11, t2), rnd), shift); \
+        v[2] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp12, t1), rnd), shift); \
+        v[5] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp12, t1), rnd), shift); \
+        v[3] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp13, t0), rnd), shift); \
+        v[4] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp13, t0), rnd), shift); \
+    }
+
+    // the same pass with v[4..7] known zero, the dropped terms were all zero
+#define LOMONT_JPEG_IDCT_1D_LOW(P, v, shift) \
+    { \
+        const auto rnd = P##set1_epi32(1 << ((shift) - 1)); \
+        const auto z1 = P##mullo_epi32(v[2], P##set1_epi32(FIX_0_541196100)); \
+        const auto tmp3 = P##add_epi32(z1, P##mullo_epi32(v[2], P##set1_epi32(FIX_0_765366865))); \
+        const auto tmp0 = P##slli_epi32(v[0], IdctConstBits); \
+        const auto tmp10 = P##add_epi32(tmp0, tmp3), tmp13 = P##sub_epi32(tmp0, tmp3); \
+        const auto tmp11 = P##add_epi32(tmp0, z1), tmp12 = P##sub_epi32(tmp0, z1); \
+        const auto z5 = P##mullo_epi32(P##add_epi32(v[3], v[1]), P##set1_epi32(FIX_1_175875602)); \
+        const auto o1 = P##mullo_epi32(v[1], P##set1_epi32(-FIX_0_899976223)); \
+        const auto o2 = P##mullo_epi32(v[3], P##set1_epi32(-FIX_2_562915447)); \
+        const auto o3 = P##add_epi32(P##mullo_epi32(v[3], P##set1_epi32(-FIX_1_961570560)), z5); \
+        const auto o4 = P##add_epi32(P##mullo_epi32(v[1], P##set1_epi32(-FIX_0_390180644)), z5); \
+        const auto t0 = P##add_epi32(o1, o3); \
+        const auto t1 = P##add_epi32(o2, o4); \
+        const auto t2 = P##add_epi32(P##mullo_epi32(v[3], P##set1_epi32(FIX_3_072711026)), P##add_epi32(o2, o3)); \
+        const auto t3 = P##add_epi32(P##mullo_epi32(v[1], P##set1_epi32(FIX_1_501321110)), P##add_epi32(o1, o4)); \
+        v[0] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp10, t3), rnd), shift); \
+        v[7] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp10, t3), rnd), shift); \
+        v[1] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp11, t2), rnd), shift); \
+        v[6] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp11, t2), rnd), shift); \
+        v[2] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp12, t1), rnd), shift); \
+        v[5] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp12, t1), rnd), shift); \
+        v[3] = P##srai_epi32(P##add_epi32(P##add_epi32(tmp13, t0), rnd), shift); \
+        v[4] = P##srai_epi32(P##add_epi32(P##sub_epi32(tmp13, t0), rnd), shift); \
+    }
+
+    // transpose 4x4 int32 in place
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void Transpose4(__m128i& a, __m128i& b, __m128i& c, __m128i& d)
+    {
+        const auto t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpackhi_epi32(a, b);
+        const auto t2 = _mm_unpacklo_epi32(c, d), t3 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(t0, t2);
+        b = _mm_unpackhi_epi64(t0, t2);
+        c = _mm_unpacklo_epi64(t1, t3);
+        d = _mm_unpackhi_epi64(t1, t3);
+    }
+
+    // transpose 8x8 held as lo (cols 0-3) and hi (cols 4-7) halves of each row
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void Transpose8(__m128i lo[8], __m128i hi[8])
+    {
+        Transpose4(lo[0], lo[1], lo[2], lo[3]);
+        Transpose4(lo[4], lo[5], lo[6], lo[7]);
+        Transpose4(hi[0], hi[1], hi[2], hi[3]);
+        Transpose4(hi[4], hi[5], hi[6], hi[7]);
+        // swap the off diagonal 4x4 blocks
+        for (int i = 0; i < 4; ++i)
+            std::swap(lo[4 + i], hi[i]);
+    }
+
+    // level shift 8 rows held as lo and hi halves, saturating packs give the 0-255 clamp
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void StoreSamples(const __m128i lo[8], const __m128i hi[8], uint8_t* out, int stride)
+    {
+        const auto bias = _mm_set1_epi32(128);
+        for (int r = 0; r < 8; ++r)
+        {
+            const auto w = _mm_packs_epi32(_mm_add_epi32(lo[r], bias), _mm_add_epi32(hi[r], bias));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + r * stride), _mm_packus_epi16(w, w));
+        }
+    }
+
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void InvertDCTSse41(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // rows in two halves, dequantize on load
+        __m128i lo[8], hi[8];
+        for (int r = 0; r < 8; ++r)
+        {
+            const auto c = reinterpret_cast<const __m128i*>(coeffs + r * 8);
+            const auto m = reinterpret_cast<const __m128i*>(mul + r * 8);
+            lo[r] = _mm_mullo_epi32(_mm_loadu_si128(c), _mm_loadu_si128(m));
+            hi[r] = _mm_mullo_epi32(_mm_loadu_si128(c + 1), _mm_loadu_si128(m + 1));
+        }
+
+        // columns, each lane is one column
+        LOMONT_JPEG_IDCT_1D(_mm_, lo, IdctConstBits - IdctPass1Bits);
+        LOMONT_JPEG_IDCT_1D(_mm_, hi, IdctConstBits - IdctPass1Bits);
+
+        // rows, after transpose each lane is one row
+        Transpose8(lo, hi);
+        LOMONT_JPEG_IDCT_1D(_mm_, lo, IdctConstBits + IdctPass1Bits + 3);
+        LOMONT_JPEG_IDCT_1D(_mm_, hi, IdctConstBits + IdctPass1Bits + 3);
+        Transpose8(lo, hi);
+        StoreSamples(lo, hi, out, stride);
+    }
+
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void InvertDCTSse41Low(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // rows 0-3 of columns 0-3, the rest stays zero through the column pass
+        __m128i lo[8], hi[8];
+        for (int r = 0; r < 8; ++r)
+        {
+            lo[r] = r < 4 ? _mm_mullo_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(coeffs + r * 8)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(mul + r * 8))) : _mm_setzero_si128();
+            hi[r] = _mm_setzero_si128();
+        }
+
+        LOMONT_JPEG_IDCT_1D_LOW(_mm_, lo, IdctConstBits - IdctPass1Bits);
+
+        // columns 4-7 are the zero inputs of the row pass
+        Transpose8(lo, hi);
+        LOMONT_JPEG_IDCT_1D_LOW(_mm_, lo, IdctConstBits + IdctPass1Bits + 3);
+        LOMONT_JPEG_IDCT_1D_LOW(_mm_, hi, IdctConstBits + IdctPass1Bits + 3);
+        Transpose8(lo, hi);
+        StoreSamples(lo, hi, out, stride);
+    }
+
+    // transpose 8x8 int32 in place, one row per vector
+    LOMONT_JPEG_TARGET("avx2")
+    inline void Transpose8(__m256i v[8])
+    {
+        const auto t0 = _mm256_unpacklo_epi32(v[0], v[1]), t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+        const auto t2 = _mm256_unpacklo_epi32(v[2], v[3]), t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+        const auto t4 = _mm256_unpacklo_epi32(v[4], v[5]), t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+        const auto t6 = _mm256_unpacklo_epi32(v[6], v[7]), t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+        const auto u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+        const auto u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+        const auto u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+        const auto u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+        v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    // level shift 8 rows, saturating packs give the 0-255 clamp
+    LOMONT_JPEG_TARGET("avx2")
+    inline void StoreSamples(const __m256i v[8], uint8_t* out, int stride)
+    {
+        const auto bias = _mm256_set1_epi32(128);
+        const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for (int r = 0; r < 8; r += 4)
+        {
+            const auto w01 = _mm256_packs_epi32(_mm256_add_epi32(v[r], bias), _mm256_add_epi32(v[r + 1], bias));
+            const auto w23 = _mm256_packs_epi32(_mm256_add_epi32(v[r + 2], bias), _mm256_add_epi32(v[r + 3], bias));
+            // packs interleave 128 bit lanes, put each row back together
+            const auto b = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(w01, w23), order);
+            alignas(32) uint8_t rows[32];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(rows), b);
+            for (int i = 0; i < 4; ++i)
+                memcpy(out + (r + i) * stride, rows + 8 * i, 8);
+        }
+    }
+
+    LOMONT_JPEG_TARGET("avx2")
+    inline void InvertDCTAvx2(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // one row per vector, dequantize on load
+        __m256i v[8];
+        for (int r = 0; r < 8; ++r)
+            v[r] = _mm256_mullo_epi32(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coeffs + r * 8)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mul + r * 8)));
+
+        // columns, each lane is one column
+        LOMONT_JPEG_IDCT_1D(_mm256_, v, IdctConstBits - IdctPass1Bits);
+
+        // rows, after transpose each lane is one row
+        Transpose8(v);
+        LOMONT_JPEG_IDCT_1D(_mm256_, v, IdctConstBits + IdctPass1Bits + 3);
+        Transpose8(v);
+        StoreSamples(v, out, stride);
+    }
+
+    LOMONT_JPEG_TARGET("avx2")
+    inline void InvertDCTAvx2Low(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride)
+    {
+        // rows 0-3, their columns 4-7 are zero
+        __m256i v[8];
+        for (int r = 0; r < 8; ++r)
+            v[r] = r < 4 ? _mm256_mullo_epi32(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coeffs + r * 8)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mul + r * 8))) : _mm256_setzero_si256();
+
+        LOMONT_JPEG_IDCT_1D_LOW(_mm256_, v, IdctConstBits - IdctPass1Bits);
+
+        // columns 4-7 stay zero, the zero inputs of the row pass
+        Transpose8(v);
+        LOMONT_JPEG_IDCT_1D_LOW(_mm256_, v, IdctConstBits + IdctPass1Bits + 3);
+        Transpose8(v);
+        StoreSamples(v, out, stride);
+    }
+
+#undef LOMONT_JPEG_IDCT_1D
+#undef LOMONT_JPEG_IDCT_1D_LOW
+
+    // pshufb masks interleaving 16 R, 16 G, 16 B bytes into 48 RGB bytes
+    // [output block 0-2][channel 0-2][byte], 0x80 gives 0
+    constexpr auto RgbInterleaveMasks = []
+        {
+            array<array<array<uint8_t, 16>, 3>, 3> m{};
+            for (int block = 0; block < 3; ++block)
+                for (int ch = 0; ch < 3; ++ch)
+                    for (int j = 0; j < 16; ++j)
+                    {
+                        const int g = 16 * block + j;
+                        m[block][ch][j] = static_cast<uint8_t>(g % 3 == ch ? g / 3 : 0x80);
+                    }
+            return m;
+        }();
+
+    // store 16 pixels of R, G, B bytes as 48 interleaved bytes
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void StoreRgb16(__m128i r, __m128i g, __m128i b, uint8_t* rgb)
+    {
+        for (int block = 0; block < 3; ++block)
+        {
+            const auto& m = RgbInterleaveMasks[block];
+            const auto o = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(r, _mm_loadu_si128(reinterpret_cast<const __m128i*>(m[0].data()))),
+                _mm_shuffle_epi8(g, _mm_loadu_si128(reinterpret_cast<const __m128i*>(m[1].data())))),
+                _mm_shuffle_epi8(b, _mm_loadu_si128(reinterpret_cast<const __m128i*>(m[2].data()))));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb + 16 * block), o);
+        }
+    }
+
+    // 4 bytes widened to int32
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline __m128i Load4U8(const uint8_t* p)
+    {
+        int32_t v;
+        memcpy(&v, p, 4);
+        return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+    }
+
+    // 16 int32 to 16 bytes, saturating packs give the 0-255 clamp
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline __m128i PackU8(const __m128i v[4])
+    {
+        return _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+    }
+
+    LOMONT_JPEG_TARGET("sse4.1")
+    inline void ColorRowSse41(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb, int count)
+    {
+        const auto half = _mm_set1_epi32(1 << (ColorFracBits - 1));
+        const auto center = _mm_set1_epi32(128);
+        int i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i R[4], G[4], B[4];
+            for (int q = 0; q < 4; ++q)
+            {
+                const int j = i + 4 * q;
+                const auto Y = Load4U8(y + j);
+                const auto Cb = _mm_sub_epi32(Load4U8(cb + j), center);
+                const auto Cr = _mm_sub_epi32(Load4U8(cr + j), center);
+                R[q] = _mm_add_epi32(Y, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(Cr, _mm_set1_epi32(ColorCrR)), half), ColorFracBits));
+                G[q] = _mm_add_epi32(Y, _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(
+                    _mm_mullo_epi32(Cb, _mm_set1_epi32(ColorCbG)), _mm_mullo_epi32(Cr, _mm_set1_epi32(ColorCrG))), half), ColorFracBits));
+                B[q] = _mm_add_epi32(Y, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(Cb, _mm_set1_epi32(ColorCbB)), half), ColorFracBits));
+            }
+            StoreRgb16(PackU8(R), PackU8(G), PackU8(B), rgb + 3 * i);
+        }
+        ColorRowScalar(y + i, cb + i, cr + i, rgb + 3 * i, count - i);
+    }
+
+    // 8 bytes widened to int32
+    LOMONT_JPEG_TARGET("avx2")
+    inline __m256i Load8U8(const uint8_t* p)
+    {
+        return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    // 16 int32 to 16 bytes, saturating packs give the 0-255 clamp,
+    // permute undoes the 128 bit lane interleave
+    LOMONT_JPEG_TARGET("avx2")
+    inline __m128i PackU8(const __m256i v[2])
+    {
+        const auto w = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[0], v[1]), 0xD8);
+        return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+    }
+
+    LOMONT_JPEG_TARGET("avx2")
+    inline void ColorRowAvx2(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb, int count)
+    {
+        const auto half = _mm256_set1_epi32(1 << (ColorFracBits - 1));
+        const auto center = _mm256_set1_epi32(128);
+        int i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m256i R[2], G[2], B[2];
+            for (int q = 0; q < 2; ++q)
+            {
+                const int j = i + 8 * q;
+                const auto Y = Load8U8(y + j);
+                const auto Cb = _mm256_sub_epi32(Load8U8(cb + j), center);
+                const auto Cr = _mm256_sub_epi32(Load8U8(cr + j), center);
+                R[q] = _mm256_add_epi32(Y, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(Cr, _mm256_set1_epi32(ColorCrR)), half), ColorFracBits));
+                G[q] = _mm256_add_epi32(Y, _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(
+                    _mm256_mullo_epi32(Cb, _mm256_set1_epi32(ColorCbG)), _mm256_mullo_epi32(Cr, _mm256_set1_epi32(ColorCrG))), half), ColorFracBits));
+                B[q] = _mm256_add_epi32(Y, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(Cb, _mm256_set1_epi32(ColorCbB)), half), ColorFracBits));
+            }
+            StoreRgb16(PackU8(R), PackU8(G), PackU8(B), rgb + 3 * i);
+        }
+        ColorRowScalar(y + i, cb + i, cr + i, rgb + 3 * i, count - i);
+    }
+
+#else
+
+    inline SimdLevel DetectSimd() { return SimdLevel::Scalar; }
+
+#endif
+
+    // integer kernels for one SIMD level, all levels give identical output
+    // idctLow and idctDc are for blocks of those shapes, see BlockShapeHigh
+    struct IntKernels
+    {
+        void (*idct)(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride) { InvertDCTInt };
+        void (*idctLow)(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride) { InvertDCTIntLow };
+        void (*idctDc)(const int coeffs[64], const int32_t mul[64], uint8_t* out, int stride) { InvertDCTIntDc };
+        void (*colorRow)(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb, int count) { ColorRowScalar };
+    };
+
+    // kernels for the requested level, falls back to what the CPU supports
+    // scale 2, 4 or 8 gives the reduced IDCT making 8/scale square blocks
+    inline IntKernels GetKernels(SimdLevel level, int scale = 1)
+    {
+        IntKernels k;
+#if defined(LOMONT_JPEG_X86)
+        level = std::min(level, DetectSimd());
+        if (level == SimdLevel::Avx2)
+        {
+            k.idct = InvertDCTAvx2;
+            k.idctLow = InvertDCTAvx2Low;
+            k.colorRow = ColorRowAvx2;
+        }
+        else if (level == SimdLevel::Sse41)
+        {
+            k.idct = InvertDCTSse41;
+            k.idctLow = InvertDCTSse41Low;
+            k.colorRow = ColorRowSse41;
+        }
+#endif
+        if (scale == 2)
+            k.idct = InvertDCTInt4;
+        else if (scale == 4)
+            k.idct = InvertDCTInt2;
+        else if (scale == 8)
+            k.idct = InvertDCTInt1;
+        if (scale != 1) // the reduced sizes are small already
+            k.idctLow = k.idctDc = k.idct;
+        return k;
+    }
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <vector>
+
+// read only file input for the decoder
+// the file is memory mapped so bytes are decoded in place with no copies,
+// if mapping fails (empty file, pipe, ...) it falls back to reading into memory
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef NOGDI
+#define NOGDI // wingdi.h defines ERROR
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        explicit MappedFile(const string& filename) { Open(filename); }
+        ~MappedFile() { Close(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // return true if the file could be read
+        bool Open(const string& filename)
+        {
+            Close();
+            if (Map(filename))
+                return true;
+
+            // fallback, read it
+            ifstream instream(filename, ios::in | ios::binary);
+            if (!instream)
+                return false;
+            copy.assign(istreambuf_iterator<char>(instream), istreambuf_iterator<char>());
+            bytes = span<const uint8_t>(copy.data(), copy.size());
+            return true;
+        }
+
+        void Close()
+        {
+            if (mapped != nullptr)
+            {
+#if defined(_WIN32)
+                UnmapViewOfFile(mapped);
+#else
+                munmap(mapped, bytes.size());
+#endif
+                mapped = nullptr;
+            }
+            copy.clear();
+            bytes = {};
+        }
+
+        span<const uint8_t> Bytes() const { return bytes; }
+        const uint8_t* data() const { return bytes.data(); }
+        size_t size() const { return bytes.size(); }
+        bool IsMapped() const { return mapped != nullptr; }
+
+    private:
+        bool Map(const string& filename)
+        {
+#if defined(_WIN32)
+            HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            LARGE_INTEGER length;
+            HANDLE mapping = nullptr;
+            if (GetFileSizeEx(file, &length) && length.QuadPart > 0)
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (mapping == nullptr)
+                return false;
+            mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+            if (mapped == nullptr)
+                return false;
+            bytes = span<const uint8_t>(static_cast<const uint8_t*>(mapped), static_cast<size_t>(length.QuadPart));
+            return true;
+#else
+            const int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            void* p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+                p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd); // the mapping stays valid
+            if (p == MAP_FAILED)
+                return false;
+            madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+            mapped = p;
+            bytes = span<const uint8_t>(static_cast<const uint8_t*>(p), static_cast<size_t>(st.st_size));
+            return true;
+#endif
+        }
+
+        void* mapped{ nullptr };
+        vector<uint8_t> copy; // used when the file cannot be mapped
+        span<const uint8_t> bytes;
+    };
+}
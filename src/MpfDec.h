@@ -15,10 +15,10 @@ namespace Lomont::Jpeg {
 	public:
 
 
-		bool Decode(Logger& dec, const vector<uint8_t>& data)
+		bool Decode(Logger& dec, span<const uint8_t> data)
 		{
 			this->dec = &dec;
-			this->data = &data;
+			this->data = data;
 			
 			// reads the structure described in Figure 6 of CIPA DC-x007-2009
 			// TIFF, like Exif stuff
@@ -43,16 +43,16 @@ namespace Lomont::Jpeg {
 				//   - 2 byte data format
 				//   - 4 bytes # of components
 				//   - 4 byte offset to data
-			dec->logi(format("Multi-Picture Format has {} entries\n", ifds.size()));
+			dec->logi("Multi-Picture Format has {} entries\n", ifds.size());
 			for (auto& ifd : ifds)
 			{
 				auto t = GetTag(ifd.tag);
 				ifd.desc = t.txt;
 				ifd.txt = t.desc;
 
-				dec->logi(format("  tag {:02X}, form {}, comp {}, offs {}: {}\n",
+				dec->logi("  tag {:02X}, form {}, comp {}, offs {}: {}\n",
 					ifd.tag, ifd.form, ifd.count, ifd.offset, ifd.desc
-				));
+				);
 			}
 			return true;
 		}
@@ -0,0 +1,260 @@
+#pragma once
+#include "JpegDecoder.h"
+
+// push mode decoding, for bytes arriving in pieces from a socket or pipe
+// Push feeds bytes as they come, Finish ends the input
+// marker segments are parsed once all their bytes are in, scans decode an MCU
+// row at a time as soon as the row's bytes are in, so with dec.onScanlines set
+// rows come out while the file is still arriving
+// progressive scans decode whole once all their bytes are in, dec.onPreview
+// shows the image improve as they arrive
+// scans decode serially, bytes are kept to the end since offsets refer to them
+// the bytes past end warning of multi picture files counts the bytes in so far
+// with dec.stats set the total time runs from construction to Finish, waits
+// for bytes included
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    class PushDecoder
+    {
+    public:
+        explicit PushDecoder(JpegDecoder& decoder, const string& name = "<push>") : dec(decoder)
+        {
+            BeginStats(dec, name);
+            dec.offset = 0;
+            dec.incremental = true;
+            SetupDecoder(dec);
+            dec.logi("Filename: {}\n", name);
+        }
+
+        // add bytes and decode as far as they go
+        // return false once decoding is done, later bytes are ignored
+        bool Push(span<const uint8_t> bytes)
+        {
+            if (phase == Phase::Done)
+                return false;
+            buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+            Run(false);
+            return phase != Phase::Done;
+        }
+
+        // end of input, decode the rest as Decode would
+        void Finish()
+        {
+            Run(true);
+            dec.incremental = false;
+            EndStats(dec);
+        }
+
+        bool Done() const { return phase == Phase::Done; }
+        size_t BytesPushed() const { return buffer.size(); }
+
+        // output rows of the current image that are decoded
+        int RowsDone() const { return rowsDone; }
+
+    private:
+        enum class Phase
+        {
+            Image, // start the next image
+            Segments, // parse marker segments
+            Scan, // decode or skip entropy coded data
+            ImageEnd, // see if another image follows
+            Done
+        };
+
+        // scan being decoded, rows are undone if they run out of bytes
+        struct Scan
+        {
+            Scan(const ScanLayout& layout, int rows, const JpegDecoder& dec) :
+                layout(layout), rows(rows), state(dec, layout), kernels(GetKernels(dec.simdLevel, dec.scale))
+            {
+            }
+            ScanLayout layout;
+            int rows; // MCU rows to decode
+            int mcuY{ 0 }; // next MCU row
+            ScopedMcuState state;
+            BitReader br;
+            IntKernels kernels;
+            Image band; // one MCU row, when streaming
+            size_t rowBytes{ 0 }; // bytes the last row used
+            size_t retryAt{ 0 }; // buffer size to reach before trying a starved row again
+        };
+
+        // least new bytes before a starved row is tried again
+        static constexpr size_t RetryBytes = 512;
+
+        void Run(bool final)
+        {
+            dec.d = span<const uint8_t>(buffer);
+            while (true)
+            {
+                switch (phase)
+                {
+                case Phase::Image:
+                    BeginImage(dec);
+                    more = true;
+                    sawEOI = false;
+                    rowsDone = 0;
+                    phase = Phase::Segments;
+                    break;
+                case Phase::Segments:
+                    if (!more || dec.lastCode != -1)
+                    {
+                        phase = Phase::ImageEnd;
+                        break;
+                    }
+                    if (!final && !SegmentReady())
+                        return;
+                    more = DecodeSegment(dec, sawEOI);
+                    if (more && dec.seg == 0xFFDA)
+                        StartScan();
+                    break;
+                case Phase::Scan:
+                    if (!DecodeScan(final))
+                        return;
+                    break;
+                case Phase::ImageEnd:
+                    if (!final && !NextImageReady())
+                        return;
+                    phase = EndImage(dec, sawEOI) ? Phase::Image : Phase::Done;
+                    break;
+                case Phase::Done:
+                    return;
+                }
+            }
+        }
+
+        // true if the whole segment at dec.offset is in
+        bool SegmentReady() const
+        {
+            const size_t offset = dec.offset;
+            if (offset + 2 > buffer.size())
+                return false;
+            const int seg = (buffer[offset] << 8) | buffer[offset + 1];
+            if (seg < 0xFFC0 || seg == 0xFFD8 || seg == 0xFFD9) // no length on these
+                return true;
+            if (offset + 4 > buffer.size())
+                return false;
+            const size_t length = (buffer[offset + 2] << 8) | buffer[offset + 3];
+            return offset + 2 + length <= buffer.size();
+        }
+
+        // true if another image starts at dec.offset, anything else after an
+        // image is only handled at the end, as Decode does with all bytes in
+        bool NextImageReady() const
+        {
+            const size_t offset = dec.offset;
+            return offset + 2 <= buffer.size() && buffer[offset] == 0xFF && buffer[offset + 1] == 0xD8;
+        }
+
+        // SOS header parsed, dec.offset is at the entropy coded data
+        void StartScan()
+        {
+            scanStart = dec.offset;
+            phase = Phase::Scan;
+            if (dec.probeOnly || dec.progressive)
+                return;
+
+            ScanLayout layout;
+            int rows = 0;
+            if (!BeginScan(dec, layout, rows))
+            {
+                phase = Phase::Segments; // as DecodeImg, parsing goes on from here
+                return;
+            }
+            scan = make_unique<Scan>(layout, rows, dec);
+            scan->br.Start(dec, dec.d, dec.offset);
+            if (dec.onScanlines)
+                scan->band.Resize(dec.GetImage()->w, layout.vmax * layout.blockSize, dec.GetImage()->channels, dec.GetImage()->format);
+        }
+
+        // decode the MCU rows whose bytes are in
+        // return false to wait for more bytes
+        bool DecodeScan(bool final)
+        {
+            if (!scan)
+            { // probe skips the scan, a progressive scan needs all its bytes
+                const size_t end = FindScanEnd(dec.d, scanStart);
+                if (end == buffer.size() && !final)
+                    return false;
+                if (dec.probeOnly)
+                {
+                    dec.offset = static_cast<int>(end);
+                    dec.logi("Probe: skipped {} bytes of scan data\n", end - scanStart);
+                }
+                else
+                    DecodeImg(dec);
+                phase = Phase::Segments;
+                return true;
+            }
+
+            auto& s = *scan;
+            auto& img = *dec.GetImage();
+            const int mcuH = s.layout.vmax * s.layout.blockSize;
+            s.br.data = buffer.data();
+            s.br.size = buffer.size();
+            bool ok = true;
+            while (ok && s.mcuY < s.rows)
+            {
+                if (!final && buffer.size() < s.retryAt)
+                    return false;
+
+                // row messages are kept until the row is known to be complete
+                const BitReader saved = s.br;
+                int lastDC[4];
+                copy(begin(s.state->lastDC), end(s.state->lastDC), lastDC);
+                const int marker = s.state->marker;
+                const auto counts = s.state->counts;
+                Logger log;
+                vector<string> messages;
+                log.logLevel = dec.logLevel;
+                if (dec.output)
+                    log.output = [&messages](const string& msg) { messages.push_back(msg); };
+                s.br.dec = &log;
+
+                const int top = dec.onScanlines ? s.mcuY * mcuH - s.layout.region.y : 0;
+                ok = DecodeMcuRow(dec, log, s.br, s.layout, *s.state, dec.onScanlines ? s.band : img, s.kernels, s.mcuY, s.rows * s.layout.mcuMaxH, top);
+                if (s.br.starved && !final)
+                { // ran past the bytes so far, undo the row
+                    s.br = saved;
+                    copy(begin(lastDC), end(lastDC), s.state->lastDC);
+                    s.state->marker = marker;
+                    s.state->counts = counts;
+                    s.retryAt = buffer.size() + max(RetryBytes, s.rowBytes / 4);
+                    return false;
+                }
+
+                s.br.dec = &dec;
+                for (auto& m : messages)
+                    dec.output(m);
+                dec.verboseCount += log.verboseCount;
+                dec.infoCount += log.infoCount;
+                dec.warningCount += log.warningCount;
+                dec.errorCount += log.errorCount;
+
+                if (dec.onScanlines)
+                    SendScanlines(dec, img, s.band, top);
+                s.rowBytes = s.br.pos - saved.pos;
+                ++s.mcuY;
+                rowsDone = clamp(s.mcuY * mcuH - s.layout.region.y, 0, img.h);
+            }
+
+            // a crop stops early, the rest of the scan is skipped up to its marker
+            if (s.rows < s.layout.mcuMaxV && !final && FindScanEnd(dec.d, s.br.pos) == buffer.size())
+                return false;
+            EndScan(dec, s.br, s.layout, *s.state, s.rows);
+            scan.reset();
+            phase = Phase::Segments;
+            return true;
+        }
+
+        JpegDecoder& dec;
+        vector<uint8_t> buffer; // all bytes pushed
+        Phase phase{ Phase::Image };
+        bool more{ true }, sawEOI{ false }; // state of the current image
+        size_t scanStart{ 0 };
+        unique_ptr<Scan> scan;
+        int rowsDone{ 0 };
+    };
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <vector>
+
+// index of the restart intervals in a scan, for random access decoding
+// holds where the entropy coded data of each interval starts, so a crop
+// can jump to the intervals it needs without scanning the bitstream
+// build with BuildRestartIndex, use by setting JpegDecoder::restartIndex
+// saves to a small sidecar file, starts are stored as varint deltas
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    struct RestartIndex
+    {
+        uint64_t fileSize{ 0 }; // to check it belongs to the file
+        int frameWidth{ 0 }, frameHeight{ 0 };
+        int interval{ 0 }; // MCUs per restart interval, from DRI
+        int mcuCount{ 0 }; // MCUs in the scan
+        uint64_t scanEnd{ 0 }; // marker after the scan
+        vector<uint64_t> starts; // entropy coded data of each interval, first is the scan start
+
+        // MCUs [first,last) of interval i
+        int First(int i) const { return i * interval; }
+        int Last(int i) const { return min(mcuCount, (i + 1) * interval); }
+
+        bool Valid() const
+        {
+            if (interval <= 0 || starts.empty() || static_cast<int>(starts.size()) != (mcuCount + interval - 1) / interval)
+                return false;
+            for (size_t i = 1; i < starts.size(); ++i)
+                if (starts[i] <= starts[i - 1])
+                    return false;
+            return starts.back() <= scanEnd && scanEnd <= fileSize;
+        }
+
+        // true if this index describes the scan at offset
+        bool Matches(uint64_t size, int width, int height, uint64_t scanOffset, int restartInterval, int intervals) const
+        {
+            return Valid() && fileSize == size && frameWidth == width && frameHeight == height &&
+                starts[0] == scanOffset && interval == restartInterval && static_cast<int>(starts.size()) == intervals;
+        }
+
+        // true if the file bytes have the RSTn markers and scan end where the index
+        // says, a file rewritten at the same size fails this
+        bool MarkersMatch(span<const uint8_t> d) const
+        {
+            if (!Valid() || d.size() != fileSize || scanEnd >= d.size() || d[scanEnd] != 0xFF)
+                return false;
+            for (size_t i = 1; i < starts.size(); ++i)
+                if (starts[i] < 2 || d[starts[i] - 2] != 0xFF || d[starts[i] - 1] != 0xD0 + ((i - 1) & 7))
+                    return false;
+            return true;
+        }
+
+        // sidecar name for a jpeg file
+        static string SidecarName(const string& filename) { return filename + ".rstidx"; }
+
+        bool Save(const string& filename) const
+        {
+            vector<uint8_t> b;
+            auto put = [&](uint64_t v, int bytes)
+                {
+                    for (int i = 0; i < bytes; ++i)
+                        b.push_back(static_cast<uint8_t>(v >> (8 * i)));
+                };
+            auto putVar = [&](uint64_t v)
+                {
+                    while (v >= 0x80)
+                    {
+                        b.push_back(static_cast<uint8_t>(v | 0x80));
+                        v >>= 7;
+                    }
+                    b.push_back(static_cast<uint8_t>(v));
+                };
+
+            put(Magic, 4);
+            put(Version, 4);
+            put(fileSize, 8);
+            put(frameWidth, 4);
+            put(frameHeight, 4);
+            put(interval, 4);
+            put(mcuCount, 4);
+            put(scanEnd, 8);
+            put(starts.size(), 4);
+            uint64_t prev = 0;
+            for (auto s : starts)
+            {
+                putVar(s - prev);
+                prev = s;
+            }
+
+            ofstream file(filename, ios::binary);
+            file.write(reinterpret_cast<const char*>(b.data()), b.size());
+            return static_cast<bool>(file);
+        }
+
+        // return false if missing, corrupt, or an unknown version
+        bool Load(const string& filename)
+        {
+            ifstream file(filename, ios::binary);
+            vector<uint8_t> b((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            size_t pos = 0;
+            bool ok = true;
+            auto get = [&](int bytes)
+                {
+                    uint64_t v = 0;
+                    if (pos + bytes > b.size())
+                    {
+                        ok = false;
+                        return v;
+                    }
+                    for (int i = 0; i < bytes; ++i)
+                        v |= static_cast<uint64_t>(b[pos++]) << (8 * i);
+                    return v;
+                };
+            auto getVar = [&]
+                {
+                    uint64_t v = 0;
+                    for (int shift = 0; shift < 64; shift += 7)
+                    {
+                        if (pos >= b.size())
+                            break;
+                        const auto c = b[pos++];
+                        v |= static_cast<uint64_t>(c & 0x7F) << shift;
+                        if ((c & 0x80) == 0)
+                            return v;
+                    }
+                    ok = false;
+                    return v;
+                };
+
+            if (get(4) != Magic || get(4) != Version)
+                return false;
+            fileSize = get(8);
+            frameWidth = static_cast<int>(get(4));
+            frameHeight = static_cast<int>(get(4));
+            interval = static_cast<int>(get(4));
+            mcuCount = static_cast<int>(get(4));
+            scanEnd = get(8);
+            const auto count = get(4);
+            if (!ok || count > b.size()) // at least a byte each
+                return false;
+            starts.clear();
+            uint64_t prev = 0;
+            for (uint64_t i = 0; i < count && ok; ++i)
+            {
+                prev += getVar();
+                starts.push_back(prev);
+            }
+            return ok && Valid();
+        }
+
+    private:
+        static constexpr uint32_t Magic = 0x49524A4C; // "LJRI"
+        static constexpr uint32_t Version = 1;
+    };
+}
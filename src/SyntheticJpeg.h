@@ -0,0 +1,393 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <string>
+#include <vector>
+
+// small baseline jpeg encoder for making test and benchmark images of any
+// size and sampling, so a corpus does not need checking in
+// the pixels are smooth gradients and waves with some noise, close enough to
+// a photo that the entropy and IDCT work is typical
+// standard tables of jpeg spec Annex K, float forward DCT, not fast, not clever
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    struct SyntheticSpec
+    {
+        int w{ 640 }, h{ 480 };
+        int channels{ 3 }; // 1 for gray, else YCbCr
+        int hs{ 2 }, vs{ 2 }; // Y sampling factors, chroma are 1x1: 1x1 4:4:4, 2x1 4:2:2, 2x2 4:2:0, 1x2 4:4:0
+        int quality{ 85 }; // 1-100, scales the Annex K tables as libjpeg does
+        int restartInterval{ 0 }; // MCUs, 0 for none
+        int lumaTables{ 0x00 }, chromaTables{ 0x11 }; // Huffman DC and AC table ids as in the SOS, DC id high nibble
+        uint32_t seed{ 1 };
+
+        // ex: "1920x1080 4:2:0 q85 dri 64", "... tables 31 02" for other Huffman ids
+        string Name() const
+        {
+            string s = to_string(w) + "x" + to_string(h) + " ";
+            if (channels == 1)
+                s += "gray";
+            else if (hs == 1 && vs == 1)
+                s += "4:4:4";
+            else if (hs == 2 && vs == 1)
+                s += "4:2:2";
+            else if (hs == 2 && vs == 2)
+                s += "4:2:0";
+            else if (hs == 1 && vs == 2)
+                s += "4:4:0";
+            else
+                s += to_string(hs) + "x" + to_string(vs);
+            s += " q" + to_string(quality);
+            if (restartInterval > 0)
+                s += " dri " + to_string(restartInterval);
+            if (lumaTables != 0x00 || chromaTables != 0x11)
+                s += " tables " + to_string(lumaTables >> 4) + to_string(lumaTables & 15) +
+                    " " + to_string(chromaTables >> 4) + to_string(chromaTables & 15);
+            return s;
+        }
+    };
+
+    namespace Synthetic
+    {
+        // natural index of the kth zigzag coefficient
+        constexpr int naturalOrder[64] = {
+             0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+            12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+            35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+            58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+        };
+
+        // Annex K.1, natural order
+        constexpr uint8_t lumaQuant[64] = {
+            16, 11, 10, 16, 24, 40, 51, 61,   12, 12, 14, 19, 26, 58, 60, 55,
+            14, 13, 16, 24, 40, 57, 69, 56,   14, 17, 22, 29, 51, 87, 80, 62,
+            18, 22, 37, 56, 68,109,103, 77,   24, 35, 55, 64, 81,104,113, 92,
+            49, 64, 78, 87,103,121,120,101,   72, 92, 95, 98,112,100,103, 99
+        };
+        constexpr uint8_t chromaQuant[64] = {
+            17, 18, 24, 47, 99, 99, 99, 99,   18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99,   47, 66, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,   99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,   99, 99, 99, 99, 99, 99, 99, 99
+        };
+
+        // Annex K.3, code counts of lengths 1-16 then symbols
+        struct HuffSpec
+        {
+            uint8_t counts[16];
+            vector<uint8_t> symbols;
+        };
+        inline const HuffSpec dcLuma{ { 0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 }, { 0,1,2,3,4,5,6,7,8,9,10,11 } };
+        inline const HuffSpec dcChroma{ { 0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 }, { 0,1,2,3,4,5,6,7,8,9,10,11 } };
+        inline const HuffSpec acLuma{ { 0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7D }, {
+            0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+            0x22,0x71,0x14,0x32,0x81,0x91,0xA1,0x08,0x23,0x42,0xB1,0xC1,0x15,0x52,0xD1,0xF0,
+            0x24,0x33,0x62,0x72,0x82,0x09,0x0A,0x16,0x17,0x18,0x19,0x1A,0x25,0x26,0x27,0x28,
+            0x29,0x2A,0x34,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+            0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+            0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+            0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,
+            0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,0xC4,0xC5,
+            0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,0xE1,0xE2,
+            0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,
+            0xF9,0xFA } };
+        inline const HuffSpec acChroma{ { 0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 }, {
+            0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+            0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xA1,0xB1,0xC1,0x09,0x23,0x33,0x52,0xF0,
+            0x15,0x62,0x72,0xD1,0x0A,0x16,0x24,0x34,0xE1,0x25,0xF1,0x17,0x18,0x19,0x1A,0x26,
+            0x27,0x28,0x29,0x2A,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,0x48,
+            0x49,0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,0x68,
+            0x69,0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x82,0x83,0x84,0x85,0x86,0x87,
+            0x88,0x89,0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,
+            0xA6,0xA7,0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,
+            0xC4,0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,
+            0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,
+            0xF9,0xFA } };
+
+        // canonical codes by symbol, jpeg spec C.2
+        struct HuffCodes
+        {
+            uint16_t code[256]{};
+            uint8_t length[256]{};
+
+            explicit HuffCodes(const HuffSpec& spec)
+            {
+                int code1 = 0, k = 0;
+                for (int len = 1; len <= 16; ++len, code1 <<= 1)
+                    for (int i = 0; i < spec.counts[len - 1]; ++i, ++code1, ++k)
+                    {
+                        code[spec.symbols[k]] = static_cast<uint16_t>(code1);
+                        length[spec.symbols[k]] = static_cast<uint8_t>(len);
+                    }
+            }
+        };
+
+        // entropy coded bytes, 0xFF is stuffed with a 0
+        struct BitWriter
+        {
+            vector<uint8_t>& out;
+            uint32_t bits{ 0 };
+            int count{ 0 };
+
+            void Write(uint32_t value, int length)
+            {
+                bits = (bits << length) | (value & ((1u << length) - 1));
+                count += length;
+                while (count >= 8)
+                {
+                    const uint8_t b = static_cast<uint8_t>(bits >> (count - 8));
+                    out.push_back(b);
+                    if (b == 0xFF)
+                        out.push_back(0);
+                    count -= 8;
+                }
+                bits &= (1u << count) - 1;
+            }
+            void Flush()
+            { // pad with 1 bits
+                if (count > 0)
+                    Write(0x7F, 8 - count);
+            }
+        };
+
+        // magnitude category of a coefficient, jpeg spec F.1.2.1
+        inline int Category(int v)
+        {
+            v = abs(v);
+            int n = 0;
+            for (; v; v >>= 1)
+                ++n;
+            return n;
+        }
+
+        inline void Put2(vector<uint8_t>& out, int v)
+        {
+            out.push_back(static_cast<uint8_t>(v >> 8));
+            out.push_back(static_cast<uint8_t>(v));
+        }
+
+        inline void PutHuffTable(vector<uint8_t>& out, int tableClassId, const HuffSpec& spec)
+        {
+            out.push_back(static_cast<uint8_t>(tableClassId));
+            out.insert(out.end(), begin(spec.counts), end(spec.counts));
+            out.insert(out.end(), spec.symbols.begin(), spec.symbols.end());
+        }
+
+        // forward DCT of a level shifted block, jpeg spec A.3.3
+        inline void ForwardDct(const float in[64], float out[64])
+        {
+            static const auto cosines = []
+                {
+                    vector<float> c(64);
+                    for (int x = 0; x < 8; ++x)
+                        for (int u = 0; u < 8; ++u)
+                            c[x * 8 + u] = static_cast<float>(cos((2 * x + 1) * u * numbers::pi / 16) * (u == 0 ? sqrt(0.125) : 0.5));
+                    return c;
+                }();
+            float rows[64];
+            for (int y = 0; y < 8; ++y)
+                for (int u = 0; u < 8; ++u)
+                {
+                    float s = 0;
+                    for (int x = 0; x < 8; ++x)
+                        s += in[y * 8 + x] * cosines[x * 8 + u];
+                    rows[y * 8 + u] = s;
+                }
+            for (int u = 0; u < 8; ++u)
+                for (int v = 0; v < 8; ++v)
+                {
+                    float s = 0;
+                    for (int y = 0; y < 8; ++y)
+                        s += rows[y * 8 + u] * cosines[y * 8 + v];
+                    out[v * 8 + u] = s;
+                }
+        }
+    }
+
+    // encode a synthetic image as a baseline jpeg file
+    inline vector<uint8_t> MakeSyntheticJpeg(const SyntheticSpec& spec)
+    {
+        using namespace Synthetic;
+        const int w = max(1, spec.w), h = max(1, spec.h);
+        const int channels = spec.channels == 1 ? 1 : 3;
+        const int hs = channels == 1 ? 1 : clamp(spec.hs, 1, 4), vs = channels == 1 ? 1 : clamp(spec.vs, 1, 4);
+        const int quality = clamp(spec.quality, 1, 100);
+
+        // pixels as YCbCr planes, full size, edges repeated out to whole MCUs
+        const int mcuW = 8 * hs, mcuH = 8 * vs;
+        const int mcusX = (w + mcuW - 1) / mcuW, mcusY = (h + mcuH - 1) / mcuH;
+        const int pw = mcusX * mcuW, ph = mcusY * mcuH;
+        vector<float> planes[3];
+        for (int c = 0; c < channels; ++c)
+            planes[c].resize(static_cast<size_t>(pw) * ph);
+        uint32_t rng = spec.seed * 2654435761u + 1;
+        for (int y = 0; y < ph; ++y)
+            for (int x = 0; x < pw; ++x)
+            {
+                const int sx = min(x, w - 1), sy = min(y, h - 1);
+                rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+                const float noise = static_cast<float>(rng % 17) - 8;
+                const float fx = static_cast<float>(sx) / w, fy = static_cast<float>(sy) / h;
+                const float r = 128 + 90 * sinf(6 * fx + 2 * fy) + noise;
+                const float g = 128 + 80 * cosf(9 * fy - 3 * fx) * sinf(20 * fx * fy) + noise;
+                const float b = 255 * fx * (1 - fy) + noise;
+                const size_t i = static_cast<size_t>(y) * pw + x;
+                if (x >= w || y >= h)
+                { // repeat the edge
+                    const size_t e = static_cast<size_t>(sy) * pw + sx;
+                    for (int c = 0; c < channels; ++c)
+                        planes[c][i] = planes[c][e];
+                    continue;
+                }
+                // jfif YCbCr, level shifted
+                planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+                if (channels == 3)
+                {
+                    planes[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    planes[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+
+        // quantization tables scaled for quality, kept in zigzag order
+        uint8_t quant[2][64];
+        const int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+        for (int k = 0; k < 64; ++k)
+        {
+            quant[0][k] = static_cast<uint8_t>(clamp((lumaQuant[naturalOrder[k]] * scale + 50) / 100, 1, 255));
+            quant[1][k] = static_cast<uint8_t>(clamp((chromaQuant[naturalOrder[k]] * scale + 50) / 100, 1, 255));
+        }
+
+        vector<uint8_t> out;
+        Put2(out, 0xFFD8);
+        Put2(out, 0xFFE0); // JFIF 1.1, no density, no thumbnail
+        Put2(out, 16);
+        for (const char ch : { 'J', 'F', 'I', 'F', '\0' })
+            out.push_back(ch);
+        for (const int b : { 1, 1, 0, 0, 1, 0, 1, 0, 0 })
+            out.push_back(static_cast<uint8_t>(b));
+
+        for (int t = 0; t < (channels == 1 ? 1 : 2); ++t)
+        {
+            Put2(out, 0xFFDB);
+            Put2(out, 67);
+            out.push_back(static_cast<uint8_t>(t));
+            out.insert(out.end(), begin(quant[t]), end(quant[t]));
+        }
+
+        Put2(out, 0xFFC0);
+        Put2(out, 8 + 3 * channels);
+        out.push_back(8);
+        Put2(out, h);
+        Put2(out, w);
+        out.push_back(static_cast<uint8_t>(channels));
+        for (int c = 0; c < channels; ++c)
+        {
+            out.push_back(static_cast<uint8_t>(c + 1));
+            out.push_back(static_cast<uint8_t>(c == 0 ? (hs << 4) | vs : 0x11));
+            out.push_back(static_cast<uint8_t>(c == 0 ? 0 : 1));
+        }
+
+        Put2(out, 0xFFC4);
+        Put2(out, 2 + (channels == 1 ? 2 : 4) * 17 + static_cast<int>(dcLuma.symbols.size() + acLuma.symbols.size() +
+            (channels == 1 ? 0 : dcChroma.symbols.size() + acChroma.symbols.size())));
+        PutHuffTable(out, spec.lumaTables >> 4, dcLuma);
+        PutHuffTable(out, 0x10 | (spec.lumaTables & 15), acLuma);
+        if (channels == 3)
+        {
+            PutHuffTable(out, spec.chromaTables >> 4, dcChroma);
+            PutHuffTable(out, 0x10 | (spec.chromaTables & 15), acChroma);
+        }
+
+        if (spec.restartInterval > 0)
+        {
+            Put2(out, 0xFFDD);
+            Put2(out, 4);
+            Put2(out, spec.restartInterval);
+        }
+
+        Put2(out, 0xFFDA);
+        Put2(out, 6 + 2 * channels);
+        out.push_back(static_cast<uint8_t>(channels));
+        for (int c = 0; c < channels; ++c)
+        {
+            out.push_back(static_cast<uint8_t>(c + 1));
+            out.push_back(static_cast<uint8_t>(c == 0 ? spec.lumaTables : spec.chromaTables));
+        }
+        out.push_back(0);
+        out.push_back(63);
+        out.push_back(0);
+
+        static const HuffCodes dcCodes[2]{ HuffCodes(dcLuma), HuffCodes(dcChroma) };
+        static const HuffCodes acCodes[2]{ HuffCodes(acLuma), HuffCodes(acChroma) };
+        BitWriter bw{ out };
+        int lastDC[3]{};
+        auto encodeBlock = [&](int c, int x0, int y0, int step, int stepY)
+            { // chroma averages step x stepY pixels into each sample
+                float in[64], coeffs[64];
+                const auto& plane = planes[c];
+                for (int y = 0; y < 8; ++y)
+                    for (int x = 0; x < 8; ++x)
+                    {
+                        float s = 0;
+                        for (int dy = 0; dy < stepY; ++dy)
+                            for (int dx = 0; dx < step; ++dx)
+                                s += plane[static_cast<size_t>(y0 + y * stepY + dy) * pw + x0 + x * step + dx];
+                        in[y * 8 + x] = s / (step * stepY);
+                    }
+                ForwardDct(in, coeffs);
+                const int t = c == 0 ? 0 : 1;
+                int zz[64];
+                for (int k = 0; k < 64; ++k)
+                    zz[k] = clamp(static_cast<int>(lround(coeffs[naturalOrder[k]] / quant[t][k])), -1023, 1023); // the Annex K AC codes end at 10 bits
+
+                const int diff = zz[0] - lastDC[c];
+                lastDC[c] = zz[0];
+                int n = Category(diff);
+                bw.Write(dcCodes[t].code[n], dcCodes[t].length[n]);
+                bw.Write(diff < 0 ? diff - 1 : diff, n);
+
+                int run = 0;
+                for (int k = 1; k < 64; ++k)
+                {
+                    if (zz[k] == 0)
+                    {
+                        ++run;
+                        continue;
+                    }
+                    for (; run > 15; run -= 16)
+                        bw.Write(acCodes[t].code[0xF0], acCodes[t].length[0xF0]); // ZRL
+                    n = Category(zz[k]);
+                    const int symbol = (run << 4) | n;
+                    bw.Write(acCodes[t].code[symbol], acCodes[t].length[symbol]);
+                    bw.Write(zz[k] < 0 ? zz[k] - 1 : zz[k], n);
+                    run = 0;
+                }
+                if (run > 0)
+                    bw.Write(acCodes[t].code[0], acCodes[t].length[0]); // EOB
+            };
+
+        const int mcus = mcusX * mcusY;
+        for (int m = 0; m < mcus; ++m)
+        {
+            if (spec.restartInterval > 0 && m > 0 && m % spec.restartInterval == 0)
+            {
+                bw.Flush();
+                Put2(out, 0xFFD0 + (m / spec.restartInterval - 1) % 8);
+                fill(begin(lastDC), end(lastDC), 0);
+            }
+            const int x0 = (m % mcusX) * mcuW, y0 = (m / mcusX) * mcuH;
+            for (int v = 0; v < vs; ++v)
+                for (int u = 0; u < hs; ++u)
+                    encodeBlock(0, x0 + u * 8, y0 + v * 8, 1, 1);
+            for (int c = 1; c < channels; ++c)
+                encodeBlock(c, x0, y0, hs, vs);
+        }
+        bw.Flush();
+        Put2(out, 0xFFD9);
+        return out;
+    }
+}
@@ -0,0 +1,196 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work stealing thread pool for the decoder
+// each worker has its own task queue, tasks submitted from a worker go on its
+// own queue, idle workers steal from the others
+// ParallelFor has the calling thread work too, so it can be used from inside a task
+namespace Lomont::Jpeg
+{
+    using namespace std;
+
+    class ThreadPool
+    {
+    public:
+        // threadCount 0 means one per hardware thread
+        explicit ThreadPool(int threadCount = 0)
+        {
+            if (threadCount <= 0)
+                threadCount = max(1, static_cast<int>(thread::hardware_concurrency()));
+            for (int i = 0; i < threadCount; ++i)
+                queues.emplace_back(make_unique<Queue>());
+            for (int i = 0; i < threadCount; ++i)
+                workers.emplace_back([this, i] { WorkerLoop(i); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                lock_guard<mutex> lock(wakeMutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& w : workers)
+                w.join();
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int Size() const { return static_cast<int>(workers.size()); }
+
+        void Submit(function<void()> task)
+        {
+            // workers keep their own tasks local, outside tasks are spread round robin
+            const int index = currentPool == this
+                ? currentIndex
+                : static_cast<int>(nextQueue++ % queues.size());
+            {
+                lock_guard<mutex> lock(queues[index]->m);
+                queues[index]->tasks.push_back(move(task));
+            }
+            {
+                lock_guard<mutex> lock(wakeMutex);
+                ++pending;
+            }
+            wake.notify_one();
+        }
+
+        // run fn(i) for i in [0,count), returns when all are done
+        // uses at most maxHelpers pool threads besides the caller, 0 for all
+        // the first exception thrown by fn is rethrown here
+        void ParallelFor(int count, const function<void(int)>& fn, int maxHelpers = 0)
+        {
+            if (count <= 0) return;
+
+            struct State
+            {
+                atomic<int> next{ 0 };
+                atomic<int> remaining{ 0 };
+                mutex doneMutex;
+                condition_variable done;
+                exception_ptr error;
+            };
+            auto state = make_shared<State>();
+            state->remaining = count;
+
+            // helpers that start after all work is claimed just exit, so fn is
+            // only touched while the caller is still waiting
+            auto work = [state, count, &fn]
+                {
+                    int i;
+                    while ((i = state->next++) < count)
+                    {
+                        try
+                        {
+                            fn(i);
+                        }
+                        catch (...)
+                        {
+                            lock_guard<mutex> lock(state->doneMutex);
+                            if (!state->error)
+                                state->error = current_exception();
+                        }
+                        if (--state->remaining == 0)
+                        {
+                            lock_guard<mutex> lock(state->doneMutex);
+                            state->done.notify_all();
+                        }
+                    }
+                };
+
+            int helpers = min(count - 1, Size());
+            if (maxHelpers > 0)
+                helpers = min(helpers, maxHelpers);
+            for (int h = 0; h < helpers; ++h)
+                Submit(work);
+            work();
+
+            unique_lock<mutex> lock(state->doneMutex);
+            state->done.wait(lock, [&] { return state->remaining == 0; });
+            if (state->error)
+                rethrow_exception(state->error);
+        }
+
+        // process wide pool, one thread per hardware thread
+        static ThreadPool& Shared()
+        {
+            static ThreadPool pool;
+            return pool;
+        }
+
+    private:
+        struct Queue
+        {
+            mutex m;
+            deque<function<void()>> tasks;
+        };
+
+        // newest task from our own queue, else the oldest from another
+        bool TryPop(int index, function<void()>& task)
+        {
+            const int n = static_cast<int>(queues.size());
+            for (int k = 0; k < n; ++k)
+            {
+                auto& q = *queues[(index + k) % n];
+                lock_guard<mutex> lock(q.m);
+                if (q.tasks.empty())
+                    continue;
+                if (k == 0)
+                {
+                    task = move(q.tasks.back());
+                    q.tasks.pop_back();
+                }
+                else
+                {
+                    task = move(q.tasks.front());
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void WorkerLoop(int index)
+        {
+            currentPool = this;
+            currentIndex = index;
+            while (true)
+            {
+                function<void()> task;
+                if (TryPop(index, task))
+                {
+                    {
+                        lock_guard<mutex> lock(wakeMutex);
+                        --pending;
+                    }
+                    task();
+                    continue;
+                }
+                unique_lock<mutex> lock(wakeMutex);
+                wake.wait(lock, [this] { return stopping || pending > 0; });
+                if (stopping && pending == 0)
+                    return;
+            }
+        }
+
+        vector<thread> workers;
+        vector<unique_ptr<Queue>> queues; // one per worker
+        atomic<unsigned> nextQueue{ 0 };
+        mutex wakeMutex;
+        condition_variable wake;
+        int pending{ 0 }; // tasks queued, not yet taken
+        bool stopping{ false };
+
+        static inline thread_local ThreadPool* currentPool{ nullptr };
+        static inline thread_local int currentIndex{ 0 };
+    };
+}
@@ -13,10 +13,10 @@ namespace Lomont::Jpeg {
 	{
 	public:
 
-		bool Decode(Logger& dec, const vector<uint8_t>& data) override
+		bool Decode(Logger& dec, span<const uint8_t> data) override
 		{
 			this->dec = &dec;
-			this->data = &data;
+			this->data = data;
 
 			// 49492A00 08000000 TIFF header (4949 = Intel order, 4d4d = motorola)
 			// 002A = length, always same (could be 2A00 via intel, motorola...)
@@ -1,6 +1,10 @@
 #pragma once
 #include <string>
+#include <concepts>
+#include <format>
 #include <functional>
+#include <span>
+#include <cstdint>
 
 
 namespace Lomont::Jpeg
@@ -15,19 +19,76 @@ namespace Lomont::Jpeg
         WARN,
         ERROR
     };
+
+    // lowest level compiled in, verbose and info messages below it compile to
+    // nothing, counts included; warnings and errors are always counted
+    // a quiet build defines LOMONT_JPEG_MIN_LOG_LEVEL=2 to drop per MCU and per table logging
+#ifndef LOMONT_JPEG_MIN_LOG_LEVEL
+#define LOMONT_JPEG_MIN_LOG_LEVEL 0
+#endif
+    constexpr int MinLogLevel = LOMONT_JPEG_MIN_LOG_LEVEL;
+
+    // messages are counted by level, output if at or above logLevel
+    // the format overloads and the callable one only make the message if it is output
     struct Logger
     {
         LogType logLevel = LogType::VERBOSE;
 
+        // true if a message of this type is output
+        bool Enabled(int type) const { return type >= MinLogLevel && type >= logLevel && output; }
+
         void log(int type, const string& msg)
         {
-            if (type >= logLevel && output)
+            if (Enabled(type))
                 output(msg);
         }
-        void logv(const string& msg) { ++verboseCount; log(LogType::VERBOSE, msg); }
-        void logi(const string& msg) { ++infoCount; log(LogType::INFO, msg); }
-        void logw(const string& msg) { ++warningCount; log(LogType::WARN, "WARNING: " + msg); }
-        void loge(const string& msg) { ++errorCount; log(LogType::ERROR, "ERROR: " + msg); }
+        void logv(const string& msg) { if constexpr (MinLogLevel <= VERBOSE) { ++verboseCount; log(LogType::VERBOSE, msg); } }
+        void logi(const string& msg) { if constexpr (MinLogLevel <= INFO) { ++infoCount; log(LogType::INFO, msg); } }
+        void logw(const string& msg) { ++warningCount; if (Enabled(LogType::WARN)) output("WARNING: " + msg); }
+        void loge(const string& msg) { ++errorCount; if (Enabled(LogType::ERROR)) output("ERROR: " + msg); }
+
+        template<typename A, typename... Args>
+        void logv(format_string<A, Args...> fmt, A&& a, Args&&... args)
+        {
+            if constexpr (MinLogLevel <= VERBOSE)
+            {
+                ++verboseCount;
+                if (Enabled(LogType::VERBOSE))
+                    output(format(fmt, forward<A>(a), forward<Args>(args)...));
+            }
+        }
+        template<typename A, typename... Args>
+        void logi(format_string<A, Args...> fmt, A&& a, Args&&... args)
+        {
+            if constexpr (MinLogLevel <= INFO)
+            {
+                ++infoCount;
+                if (Enabled(LogType::INFO))
+                    output(format(fmt, forward<A>(a), forward<Args>(args)...));
+            }
+        }
+        template<typename A, typename... Args>
+        void logw(format_string<A, Args...> fmt, A&& a, Args&&... args)
+        {
+            ++warningCount;
+            if (Enabled(LogType::WARN))
+                output("WARNING: " + format(fmt, forward<A>(a), forward<Args>(args)...));
+        }
+        template<typename A, typename... Args>
+        void loge(format_string<A, Args...> fmt, A&& a, Args&&... args)
+        {
+            ++errorCount;
+            if (Enabled(LogType::ERROR))
+                output("ERROR: " + format(fmt, forward<A>(a), forward<Args>(args)...));
+        }
+
+        // message built by make, for ones made in pieces
+        // a template so the lambda is called in place, nothing is built when the level is off
+        template<invocable F>
+        void logv(F&& make) { if constexpr (MinLogLevel <= VERBOSE) { ++verboseCount; if (Enabled(LogType::VERBOSE)) output(make()); } }
+        template<invocable F>
+        void logi(F&& make) { if constexpr (MinLogLevel <= INFO) { ++infoCount; if (Enabled(LogType::INFO)) output(make()); } }
+
         function<void(const string& msg)> output{ nullptr };
 
         int verboseCount{ 0 }, infoCount{ 0 }, warningCount{ 0 }, errorCount{ 0 };
@@ -38,12 +99,12 @@ namespace Lomont::Jpeg
     class Decoder
     {
     public:
-        virtual bool Decode(Logger& dec, const vector<uint8_t>& data) = 0;
+        virtual bool Decode(Logger& dec, span<const uint8_t> data) = 0;
         virtual ~Decoder() {}
 
     protected:
         Logger* dec {nullptr};
-        const vector<uint8_t> * data;
+        span<const uint8_t> data;
         int readPos{ 0 };
 
         int read(int n)
@@ -52,7 +113,7 @@ namespace Lomont::Jpeg
             int len = n;
             for (int p = 0; p < n; ++p)
             {
-                int d = (*data)[readPos++];
+                int d = data[readPos++];
                 if (isMoto)
                     v = 256 * v + d;
                 else if (isIntel)
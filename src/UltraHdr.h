@@ -1,6 +1,7 @@
 #pragma once
 #include <format>
 #include <vector>
+#include <span>
 #include <regex>
 #include <ostream>
 
@@ -45,7 +46,7 @@ public:
     std::vector<double> capacityMin, capacityMax;
 
 	// feed xmp strings here
-	void ParseXmp(Lomont::Jpeg::Logger& dec, const std::vector<uint8_t>& data)
+	void ParseXmp(Lomont::Jpeg::Logger& dec, std::span<const uint8_t> data)
 	{
         // nice C++ regex cheatsheet https://cpprocks.com/files/c++11-regex-cheatsheet.pdf
 
@@ -75,10 +76,13 @@ public:
             // validate parameters:
             // todo;
 
-            dec.logi(std::format("UltraHDR detected. Parameters:\n"));
-            std::stringstream ss;
-            Dump(ss, "   ");
-            dec.logi(ss.str());
+            dec.logi("UltraHDR detected. Parameters:\n");
+            dec.logi([this]
+                {
+                    std::stringstream ss;
+                    Dump(ss, "   ");
+                    return ss.str();
+                });
             hasUltraHdr = true;
         }
 	}
@@ -14,10 +14,10 @@ namespace Lomont::Jpeg {
 	{
 	public:
 
-		bool Decode(Logger& dec, const vector<uint8_t>& data)
+		bool Decode(Logger& dec, span<const uint8_t> data)
 		{
 			this->dec = &dec;
-			this->data = &data;
+			this->data = data;
 
 			//std::stringstream ss;
 			//HexDump(data.data(), data.size(), ss, 16, 8);
@@ -31,7 +31,7 @@ namespace Lomont::Jpeg {
 				guid[i] = read(1);
 			guid[32] = 0;
 			int size = read(4);
-			dec.logi(format("   XMP GUID is {}, size {}\n", guid, size));
+			dec.logi("   XMP GUID is {}, size {}\n", guid, size);
 
 
 			return true;
@@ -0,0 +1,686 @@
+#include "JpegDecoder.h"
+#include "PushDecoder.h"
+#include "SyntheticJpeg.h"
+
+using namespace Lomont::Jpeg;
+
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <sstream>
+
+// golden output regression test, guards the optimized decode paths
+// every file in jpegtests, HDR and tests/data (run from the repository root) is
+// decoded in each decoder mode:
+//  - the reference IDCT must match its golden hashes exactly
+//  - every fast mode (threads, SIMD levels, streaming, push, reuse, restart index,
+//    the last progressive preview) must match the serial fast decode exactly, and the golden fast hashes; a
+//    changed fast hash is allowed while the PSNR and largest difference against
+//    the reference decode stay within the golden bounds, so kernels can change
+//    output within tolerance but never silently beyond it
+//  - options changing the output (scale, crop, output buffers and formats, planar)
+//    have golden hashes, reported like fast ones, and checks that hold for any
+//    pixel values: a scaled decode is near the box average of the reference, a
+//    crop is that rectangle of the full decode, other formats rearrange RGB and
+//    the planar Y plane is the gray output
+// generated images have no goldens, they get the same mode and tolerance checks,
+// and ones coded differently from another must decode the same as it
+// tests/data/progressive has lossless progressive recodes of jpegtests files, name_rst
+// with restart intervals, which must decode the same as the sequential file
+//
+// usage: GoldenTests [--update] [golden file]
+//   the golden file defaults to tests/golden.txt, --update rewrites it
+//   from the decodes of this build
+
+//--------------------------------------------------------------------------//
+using namespace ::std;
+namespace fs = ::std::filesystem;
+
+// pixels of one image, packed RGB rows
+struct Pixels
+{
+    int w{ 0 }, h{ 0 };
+    vector<uint8_t> rgb;
+    int channels{ 0 }; // as coded
+
+    uint64_t Hash() const
+    { // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (const auto b : rgb)
+            hash = (hash ^ b) * 1099511628211ull;
+        return hash;
+    }
+};
+
+struct Golden
+{
+    uint64_t refHash{ 0 }, fastHash{ 0 };
+    int w{ 0 }, h{ 0 };
+    double minPsnr{ 0 }; // fast against reference
+    int maxDiff{ 0 };
+};
+
+// "file image" to its golden
+using Goldens = map<string, Golden>;
+
+// output of a decoder option, fast IDCT like fastHash
+struct OptionGolden
+{
+    int w{ 0 }, h{ 0 };
+    uint64_t hash{ 0 };
+};
+// "file image option" to its golden
+using OptionGoldens = map<string, OptionGolden>;
+
+// error bounds for generated images, and new files until goldens are written
+constexpr double DefaultMinPsnr = 30;
+constexpr int DefaultMaxDiff = 32;
+
+string Key(const string& filename, size_t image) { return format("{} {}", filename, image); }
+
+Pixels ToPixels(const Image& img)
+{
+    Pixels p{ img.w, img.h, {}, img.channels };
+    if (img.format == PixelFormat::YCbCrPlanar)
+    { // the planes one after another
+        for (const auto& plane : img.planes)
+            p.rgb.insert(p.rgb.end(), plane.begin(), plane.end());
+        return p;
+    }
+    const size_t rowBytes = static_cast<size_t>(img.w) * img.PixelSize();
+    if (img.data.empty() && !img.external)
+    { // nothing decoded
+        p.rgb.assign(rowBytes * img.h, 0);
+        return p;
+    }
+    for (int y = 0; y < img.h; ++y)
+        p.rgb.insert(p.rgb.end(), img.Row(y), img.Row(y) + rowBytes);
+    return p;
+}
+
+vector<Pixels> Images(const JpegDecoder& dec)
+{
+    vector<Pixels> images;
+    for (const auto& img : dec.images)
+        images.push_back(ToPixels(*img));
+    return images;
+}
+
+struct Mode
+{
+    string name;
+    IdctMode idct{ IdctMode::Fast };
+    int threads{ 1 };
+    SimdLevel simd{ DetectSimd() };
+    enum class Kind { Plain, Streaming, Push, Reuse, Indexed, Preview } kind{ Kind::Plain };
+};
+
+// decode bytes in a mode, reused is the decoder kept across files for Reuse
+vector<Pixels> DecodeIn(const Mode& mode, const string& name, span<const uint8_t> bytes, JpegDecoder& reused)
+{
+    JpegDecoder fresh;
+    auto& dec = mode.kind == Mode::Kind::Reuse ? reused : fresh;
+    if (&dec == &reused)
+        dec.Reset();
+    dec.output = [](const string&) {};
+    dec.logLevel = LogType::ERROR;
+    dec.idctMode = mode.idct;
+    dec.threads = mode.threads;
+    dec.simdLevel = mode.simd;
+
+    switch (mode.kind)
+    {
+    case Mode::Kind::Streaming:
+    {
+        map<const Image*, vector<uint8_t>> rows;
+        dec.onScanlines = [&](const Image& img, int y, int, span<const uint8_t> pixels)
+            {
+                auto& p = rows[&img];
+                p.resize(static_cast<size_t>(img.w) * img.h * img.PixelSize());
+                copy(pixels.begin(), pixels.end(), p.begin() + static_cast<size_t>(y) * img.w * img.PixelSize());
+            };
+        Decode(bytes, dec, name);
+        vector<Pixels> images;
+        for (const auto& img : dec.images)
+        {
+            Pixels p{ img->w, img->h, move(rows[img.get()]), img->channels };
+            p.rgb.resize(static_cast<size_t>(img->w) * img->h * img->PixelSize()); // no rows sent is all 0
+            images.push_back(move(p));
+        }
+        return images;
+    }
+    case Mode::Kind::Push:
+    {
+        PushDecoder push(dec, name);
+        for (size_t i = 0; i < bytes.size(); i += 4096)
+            push.Push(bytes.subspan(i, min<size_t>(4096, bytes.size() - i)));
+        push.Finish();
+        break;
+    }
+    case Mode::Kind::Indexed:
+    {
+        auto index = make_shared<RestartIndex>();
+        {
+            JpegDecoder probe;
+            probe.output = [](const string&) {};
+            probe.indexOut = index.get();
+            Probe(bytes, probe, name);
+        }
+        dec.restartIndex = index;
+        Decode(bytes, dec, name);
+        break;
+    }
+    case Mode::Kind::Preview:
+    { // progressive images are their last preview, which must be the final image
+        map<const Image*, Pixels> previews;
+        dec.onPreview = [&](const Image& img, int) { previews[&img] = ToPixels(img); };
+        Decode(bytes, dec, name);
+        auto images = Images(dec);
+        for (size_t i = 0; i < images.size(); ++i)
+            if (const auto it = previews.find(dec.images[i].get()); it != previews.end())
+                images[i] = it->second;
+        return images;
+    }
+    default:
+        Decode(bytes, dec, name);
+        break;
+    }
+    return Images(dec);
+}
+
+// PSNR of a against b, 99 when equal, and the largest difference
+pair<double, int> Compare(const Pixels& a, const Pixels& b)
+{
+    if (a.rgb.size() != b.rgb.size())
+        return { 0, 255 };
+    double se = 0;
+    int maxDiff = 0;
+    for (size_t i = 0; i < a.rgb.size(); ++i)
+    {
+        const int d = a.rgb[i] - b.rgb[i];
+        se += d * d;
+        maxDiff = max(maxDiff, abs(d));
+    }
+    if (se == 0)
+        return { 99, 0 };
+    return { min(99.0, 10 * log10(255.0 * 255.0 * a.rgb.size() / se)), maxDiff };
+}
+
+// decoder options that change the output layout, each has its own golden hash
+// and is checked against the plain decodes by what the option means
+struct Option
+{
+    string name;
+    int scale{ 1 };
+    bool crop{ false }; // the rectangle from CropFor
+    bool indexed{ false }; // crop seeking through a restart index
+    PixelFormat format{ PixelFormat::RGB };
+    bool buffer{ false }; // into caller memory with padded rows
+};
+
+// crop rectangle for an image, off the MCU grid
+Rect CropFor(const Pixels& p) { return { p.w / 5 + 3, p.h / 5 + 1, p.w / 2, p.h / 2 }; }
+
+// decode bytes with an option, problem gets what went wrong with caller memory
+vector<Pixels> DecodeOption(const Option& option, const string& name, span<const uint8_t> bytes, const Rect& crop, string& problem)
+{
+    JpegDecoder dec;
+    dec.output = [](const string&) {};
+    dec.logLevel = LogType::ERROR;
+    dec.threads = 1;
+    dec.scale = option.scale;
+    dec.pixelFormat = option.format;
+    if (option.crop)
+        dec.crop = crop;
+    bool indexUsed = false;
+    if (option.indexed)
+    {
+        auto index = make_shared<RestartIndex>();
+        JpegDecoder probe;
+        probe.output = [](const string&) {};
+        probe.indexOut = index.get();
+        Probe(bytes, probe, name);
+        dec.restartIndex = index;
+        dec.logLevel = LogType::INFO;
+        dec.output = [&](const string& msg) { indexUsed |= msg.find("Using restart index") != string::npos; };
+    }
+
+    // rows padded past their pixels, the padding must stay untouched
+    constexpr int Padding = 13;
+    constexpr uint8_t Fill = 0xCD;
+    map<const Image*, vector<uint8_t>> buffers;
+    if (option.buffer)
+        dec.outputBuffer = [&](const Image& img, int& stride)
+            {
+                stride = img.w * img.PixelSize() + Padding;
+                auto& b = buffers[&img];
+                b.assign(static_cast<size_t>(stride) * img.h, Fill);
+                for (int y = 0; y < img.h; ++y) // pixels start 0, as in the decoder's own memory
+                    fill_n(b.begin() + static_cast<size_t>(y) * stride, stride - Padding, 0);
+                return span<uint8_t>(b);
+            };
+    Decode(bytes, dec, name);
+
+    if constexpr (MinLogLevel <= LogType::INFO)
+        if (option.indexed && dec.restartIndex->Valid() && !indexUsed)
+            problem += "restart index not used\n";
+
+    for (const auto& img : dec.images)
+    {
+        if (!option.buffer || img->w == 0 || img->h == 0)
+            continue;
+        const auto& b = buffers[img.get()];
+        if (img->external != b.data())
+            problem += format("{}x{} image not decoded into the output buffer\n", img->w, img->h);
+        else
+            for (int y = 0; y < img->h; ++y)
+            {
+                const auto pad = b.begin() + static_cast<size_t>(y) * img->stride + img->w * img->PixelSize();
+                if (any_of(pad, pad + Padding, [=](uint8_t v) { return v != Fill; }))
+                {
+                    problem += format("row {} padding overwritten\n", y);
+                    break;
+                }
+            }
+    }
+    return Images(dec);
+}
+
+// the rectangle r of an image
+Pixels SubImage(const Pixels& p, const Rect& r)
+{
+    const int bpp = p.w * p.h == 0 ? 3 : static_cast<int>(p.rgb.size() / (static_cast<size_t>(p.w) * p.h));
+    Pixels sub{ r.w, r.h, {} };
+    for (int y = r.y; y < r.y + r.h; ++y)
+    {
+        const auto row = p.rgb.begin() + (static_cast<size_t>(y) * p.w + r.x) * bpp;
+        sub.rgb.insert(sub.rgb.end(), row, row + static_cast<size_t>(r.w) * bpp);
+    }
+    return sub;
+}
+
+// RGB image averaged over scale x scale boxes, the size a scaled decode has
+Pixels BoxAverage(const Pixels& p, int scale)
+{
+    Pixels avg{ (p.w + scale - 1) / scale, (p.h + scale - 1) / scale, {} };
+    avg.rgb.resize(static_cast<size_t>(avg.w) * avg.h * 3);
+    for (int y = 0; y < avg.h; ++y)
+        for (int x = 0; x < avg.w; ++x)
+            for (int c = 0; c < 3; ++c)
+            {
+                int sum = 0, count = 0;
+                for (int j = y * scale; j < min(p.h, (y + 1) * scale); ++j)
+                    for (int i = x * scale; i < min(p.w, (x + 1) * scale); ++i, ++count)
+                        sum += p.rgb[(static_cast<size_t>(j) * p.w + i) * 3 + c];
+                avg.rgb[(static_cast<size_t>(y) * avg.w + x) * 3 + c] = static_cast<uint8_t>((sum + count / 2) / count);
+            }
+    return avg;
+}
+
+// RGB rearranged as format
+Pixels Permute(const Pixels& p, PixelFormat format)
+{
+    const int bpp = BytesPerPixel(format);
+    Pixels out{ p.w, p.h, vector<uint8_t>(p.rgb.size() / 3 * bpp) };
+    for (size_t i = 0; i < p.rgb.size() / 3; ++i)
+        StoreRgbRow(p.rgb.data() + i * 3, out.rgb.data() + i * bpp, 1, format);
+    return out;
+}
+
+// least PSNR of a scaled decode against the box average of the reference decode
+double ScaledMinPsnr(int scale) { return scale == 2 ? 30 : scale == 4 ? 27 : 24; }
+
+// what is wrong with image i of an option decode, empty if it is right
+// done has the decodes of the options before this one
+string CheckOption(const Option& option, const Pixels& image, size_t i, const vector<Pixels>& ref, const vector<Pixels>& fast,
+    const map<string, vector<Pixels>>& done, const Rect& crop)
+{
+    auto same = [&](const Pixels& expected, const string& what)
+        {
+            if (image.w == expected.w && image.h == expected.h && image.Hash() == expected.Hash())
+                return string();
+            return format("differs from {}\n", what);
+        };
+    if (fast[i].channels == 4)
+        return {}; // CMYK is not decoded, its pixels are whatever the memory held
+    if (option.scale != 1)
+    { // a scaled decode keeps the low frequencies, so it is near the average of each box
+        const auto avg = BoxAverage(ref[i], option.scale);
+        if (image.w != avg.w || image.h != avg.h)
+            return format("{}x{}, expected {}x{}\n", image.w, image.h, avg.w, avg.h);
+        const auto [psnr, maxDiff] = Compare(image, avg);
+        if (psnr < ScaledMinPsnr(option.scale))
+            return format("psnr {:.2f} against the box average of the reference, bound {:.1f}\n", psnr, ScaledMinPsnr(option.scale));
+        return {};
+    }
+    if (option.indexed)
+        return same(done.at("crop")[i], "the crop decoded without the index");
+    if (option.crop)
+    {
+        const Rect whole{ 0, 0, fast[i].w, fast[i].h };
+        const auto r = crop.Intersect(whole);
+        return same(SubImage(fast[i], r.Empty() ? whole : r), "the same rectangle of the full decode");
+    }
+    switch (option.format)
+    {
+    case PixelFormat::RGB:
+        return same(fast[i], "the fast decode");
+    case PixelFormat::BGR:
+    case PixelFormat::RGBA:
+    case PixelFormat::BGRA:
+        return same(Permute(done.at("buffer-rgb")[i], option.format), "the RGB output rearranged");
+    case PixelFormat::YCbCrPlanar:
+    { // Y comes first, and is what gray output has
+        const auto& gray = done.at("buffer-gray")[i];
+        if (image.w != gray.w || image.h != gray.h || image.rgb.size() < gray.rgb.size() ||
+            !equal(gray.rgb.begin(), gray.rgb.end(), image.rgb.begin()))
+            return "Y plane differs from the gray output\n";
+        return {};
+    }
+    default:
+        return {};
+    }
+}
+
+const string GoldenHeader =
+    "# golden decodes for tests/GoldenTests.cpp, rewrite with GoldenTests --update\n"
+    "# file image width height reference-hash fast-hash fast-min-psnr fast-max-diff\n"
+    "# file image option width height hash\n";
+
+// notes are the other comment lines, kept across --update
+Goldens Load(const string& filename, OptionGoldens& optionGoldens, vector<string>& notes)
+{
+    Goldens goldens;
+    ifstream file(filename);
+    string line;
+    while (getline(file, line))
+    {
+        if (!line.empty() && line[0] == '#' && GoldenHeader.find(line + "\n") == string::npos)
+            notes.push_back(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        stringstream s(line);
+        string name, option;
+        size_t image;
+        s >> name >> image >> option;
+        if (!option.empty() && !isdigit(static_cast<unsigned char>(option[0])))
+        {
+            OptionGolden g;
+            s >> g.w >> g.h >> hex >> g.hash;
+            if (s)
+                optionGoldens[Key(name, image) + " " + option] = g;
+            continue;
+        }
+        Golden g;
+        g.w = s ? stoi(option) : 0;
+        s >> g.h >> hex >> g.refHash >> g.fastHash >> dec >> g.minPsnr >> g.maxDiff;
+        if (s)
+            goldens[Key(name, image)] = g;
+    }
+    return goldens;
+}
+
+void Save(const string& filename, const Goldens& goldens, const OptionGoldens& optionGoldens, const vector<string>& notes)
+{
+    ofstream file(filename);
+    file << GoldenHeader;
+    for (const auto& note : notes)
+        file << note << '\n';
+    for (const auto& [key, g] : goldens)
+        file << format("{} {} {} {:016x} {:016x} {:.1f} {}\n", key, g.w, g.h, g.refHash, g.fastHash, g.minPsnr, g.maxDiff);
+    for (const auto& [key, g] : optionGoldens)
+        file << format("{} {} {} {:016x}\n", key, g.w, g.h, g.hash);
+}
+
+int main(int argc, char* argv[])
+{
+    bool update = false;
+    string goldenFilename = "tests/golden.txt";
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (arg == "--update")
+            update = true;
+        else
+            goldenFilename = arg;
+    }
+
+    vector<string> notes;
+    OptionGoldens optionGoldens;
+    auto goldens = Load(goldenFilename, optionGoldens, notes);
+    if (update)
+    {
+        goldens.clear();
+        optionGoldens.clear();
+    }
+    else if (goldens.empty())
+    {
+        cout << format("No goldens in {}, run from the repository root\n", goldenFilename);
+        return 1;
+    }
+
+    // inputs, generated ones named for their spec
+    struct Input
+    {
+        string name;
+        vector<uint8_t> bytes;
+        size_t sameAs{ SIZE_MAX }; // input with the same pixels, if any
+    };
+    vector<Input> inputs;
+    set<fs::path> sorted_by_name;
+    for (const auto dir : { "jpegtests", "HDR", "tests/data" })
+        if (fs::is_directory(dir))
+            for (auto& p : fs::recursive_directory_iterator(dir))
+                if (p.path().extension() == ".jpg")
+                    sorted_by_name.insert(p.path());
+    for (const auto& p : sorted_by_name)
+    {
+        MappedFile file(p.generic_string());
+        inputs.push_back({ p.generic_string(), vector<uint8_t>(file.Bytes().begin(), file.Bytes().end()) });
+    }
+    for (auto& input : inputs)
+    {
+        const fs::path p = input.name;
+        if (p.parent_path() != "tests/data/progressive")
+            continue;
+        auto stem = p.stem().string();
+        if (stem.ends_with("_rst"))
+            stem.resize(stem.size() - 4);
+        const auto sequential = "jpegtests/" + stem + ".jpg";
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (inputs[i].name == sequential)
+                input.sameAs = i;
+    }
+    const size_t fileCount = inputs.size();
+    for (const auto& [hs, vs, channels] : { tuple{ 1, 1, 3 }, tuple{ 2, 1, 3 }, tuple{ 2, 2, 3 }, tuple{ 1, 2, 3 }, tuple{ 1, 1, 1 }, tuple{ 3, 2, 3 } })
+        for (const int dri : { 0, 5 })
+        {
+            const SyntheticSpec spec{ .w = 203, .h = 117, .channels = channels, .hs = hs, .vs = vs, .restartInterval = dri };
+            inputs.push_back({ "synthetic " + spec.Name(), MakeSyntheticJpeg(spec) });
+
+            // unusual Huffman table ids, luma off table 0 and chroma on it
+            if ((hs == 2 && vs == 2) || channels == 1)
+            {
+                SyntheticSpec other = spec;
+                other.lumaTables = 0x31;
+                other.chromaTables = 0x02;
+                inputs.push_back({ "synthetic " + other.Name(), MakeSyntheticJpeg(other), inputs.size() - 1 });
+            }
+        }
+
+    vector<Mode> modes = {
+        { .name = "ref-mt", .idct = IdctMode::Reference, .threads = 0 },
+        { .name = "fast-mt", .threads = 0 },
+        { .name = "stream", .kind = Mode::Kind::Streaming },
+        { .name = "push", .kind = Mode::Kind::Push },
+        { .name = "reuse", .kind = Mode::Kind::Reuse },
+        { .name = "indexed", .kind = Mode::Kind::Indexed },
+        { .name = "preview", .kind = Mode::Kind::Preview },
+    };
+    for (int level = 0; level < static_cast<int>(DetectSimd()); ++level)
+        modes.push_back({ .name = format("simd{}", level), .simd = static_cast<SimdLevel>(level) });
+    const Mode refMode{ .name = "ref", .idct = IdctMode::Reference };
+    const Mode fastMode{ .name = "fast" };
+
+    // in order, the checks of later ones use earlier decodes
+    const vector<Option> options = {
+        { .name = "scale2", .scale = 2 },
+        { .name = "scale4", .scale = 4 },
+        { .name = "scale8", .scale = 8 },
+        { .name = "crop", .crop = true },
+        { .name = "crop-indexed", .crop = true, .indexed = true },
+        { .name = "buffer-rgb", .buffer = true },
+        { .name = "buffer-bgr", .format = PixelFormat::BGR, .buffer = true },
+        { .name = "buffer-rgba", .format = PixelFormat::RGBA, .buffer = true },
+        { .name = "buffer-bgra", .format = PixelFormat::BGRA, .buffer = true },
+        { .name = "buffer-gray", .format = PixelFormat::Gray, .buffer = true },
+        { .name = "planar", .format = PixelFormat::YCbCrPlanar },
+    };
+
+    int failures = 0, changed = 0, checks = 0;
+    JpegDecoder reused;
+    auto fail = [&](const string& msg)
+        {
+            cout << "FAIL " << msg;
+            ++failures;
+        };
+
+    for (size_t f = 0; f < inputs.size(); ++f)
+    {
+        const auto& [name, bytes, sameAs] = inputs[f];
+        const bool hasGoldens = f < fileCount;
+        const auto ref = DecodeIn(refMode, name, bytes, reused);
+        const auto fast = DecodeIn(fastMode, name, bytes, reused);
+        if (ref.size() != fast.size())
+        {
+            fail(format("{}: {} reference images, {} fast\n", name, ref.size(), fast.size()));
+            continue;
+        }
+        if (sameAs != SIZE_MAX && !update)
+        {
+            const auto& same = inputs[sameAs];
+            for (const auto& [mode, images] : { pair{ &refMode, &ref }, pair{ &fastMode, &fast } })
+            {
+                const auto expected = DecodeIn(*mode, same.name, same.bytes, reused);
+                ++checks;
+                if (expected.size() != images->size() || (!images->empty() && expected[0].Hash() != (*images)[0].Hash()))
+                    fail(format("{} {}: decodes differently from {}\n", name, mode->name, same.name));
+            }
+        }
+
+        for (size_t i = 0; i < ref.size(); ++i)
+        {
+            const auto key = Key(name, i);
+            const auto [psnr, maxDiff] = Compare(fast[i], ref[i]);
+            if (update && hasGoldens)
+            {
+                goldens[key] = { ref[i].Hash(), fast[i].Hash(), ref[i].w, ref[i].h,
+                    max(0.0, floor(psnr) - 1), maxDiff + 2 };
+                continue;
+            }
+
+            Golden g{ 0, 0, ref[i].w, ref[i].h, DefaultMinPsnr, DefaultMaxDiff };
+            if (hasGoldens)
+            {
+                const auto it = goldens.find(key);
+                if (it == goldens.end())
+                {
+                    fail(format("{}: no golden, rerun with --update\n", key));
+                    continue;
+                }
+                g = it->second;
+                ++checks;
+                if (ref[i].Hash() != g.refHash || ref[i].w != g.w || ref[i].h != g.h)
+                    fail(format("{}: reference output changed, {}x{} hash {:016x}\n", key, ref[i].w, ref[i].h, ref[i].Hash()));
+                if (fast[i].Hash() != g.fastHash)
+                {
+                    ++changed;
+                    cout << format("CHANGED {}: fast output differs from golden, psnr {:.2f} max diff {}\n", key, psnr, maxDiff);
+                }
+            }
+            ++checks;
+            if (psnr < g.minPsnr || maxDiff > g.maxDiff)
+                fail(format("{}: fast psnr {:.2f} max diff {} against the reference, bounds {:.1f} {}\n", key, psnr, maxDiff, g.minPsnr, g.maxDiff));
+        }
+        // options, against their goldens and the decodes above
+        const auto crop = fast.empty() ? Rect{} : CropFor(fast[0]);
+        map<string, vector<Pixels>> done;
+        for (const auto& option : options)
+        {
+            string problem;
+            auto& images = done[option.name] = DecodeOption(option, name, bytes, crop, problem);
+            ++checks;
+            if (!problem.empty())
+                fail(format("{} {}: {}", name, option.name, problem));
+            if (images.size() != fast.size())
+            {
+                fail(format("{} {}: {} images, expected {}\n", name, option.name, images.size(), fast.size()));
+                images.resize(fast.size());
+                continue;
+            }
+            for (size_t i = 0; i < images.size(); ++i)
+            {
+                const auto key = Key(name, i) + " " + option.name;
+                if (update && hasGoldens)
+                {
+                    optionGoldens[key] = { images[i].w, images[i].h, images[i].Hash() };
+                    continue;
+                }
+                if (hasGoldens)
+                {
+                    const auto it = optionGoldens.find(key);
+                    ++checks;
+                    if (it == optionGoldens.end())
+                        fail(format("{}: no golden, rerun with --update\n", key));
+                    else if (images[i].w != it->second.w || images[i].h != it->second.h)
+                        fail(format("{}: {}x{}, golden {}x{}\n", key, images[i].w, images[i].h, it->second.w, it->second.h));
+                    else if (images[i].Hash() != it->second.hash)
+                    {
+                        ++changed;
+                        cout << format("CHANGED {}: output differs from golden\n", key);
+                    }
+                }
+                ++checks;
+                const auto wrong = CheckOption(option, images[i], i, ref, fast, done, crop);
+                if (!wrong.empty())
+                    fail(format("{}: {}", key, wrong));
+            }
+        }
+
+        if (hasGoldens && !update && goldens.contains(Key(name, ref.size())))
+            fail(format("{}: {} images, the goldens have more\n", name, ref.size()));
+        if (update)
+            continue;
+
+        // the other modes must match the serial decodes exactly
+        for (const auto& mode : modes)
+        {
+            const auto images = DecodeIn(mode, name, bytes, reused);
+            const auto& expected = mode.idct == IdctMode::Reference ? ref : fast;
+            ++checks;
+            if (images.size() != expected.size())
+            {
+                fail(format("{} {}: {} images, expected {}\n", name, mode.name, images.size(), expected.size()));
+                continue;
+            }
+            for (size_t i = 0; i < images.size(); ++i)
+                if (images[i].Hash() != expected[i].Hash() || images[i].w != expected[i].w || images[i].h != expected[i].h)
+                {
+                    const auto [psnr, maxDiff] = Compare(images[i], expected[i]);
+                    fail(format("{} {}: differs from the serial decode, psnr {:.2f} max diff {}\n", Key(name, i), mode.name, psnr, maxDiff));
+                }
+        }
+    }
+
+    if (update)
+    {
+        Save(goldenFilename, goldens, optionGoldens, notes);
+        cout << format("{} goldens written to {}\n", goldens.size() + optionGoldens.size(), goldenFilename);
+        return 0;
+    }
+    cout << format("{} inputs, {} modes, {} checks, {} fast outputs changed from golden, {} failures\n",
+        inputs.size(), modes.size() + options.size() + 2, checks, changed, failures);
+    return failures == 0 ? 0 : 1;
+}